@@ -0,0 +1,210 @@
+#ifndef __AVL_H__
+#define __AVL_H__
+
+/* intrusive AVL tree with parent pointers, in the style of c_list.h */
+
+#include <stddef.h>
+
+struct avl_node {
+	struct avl_node *parent, *left, *right;
+	int height;
+};
+
+struct avl_root {
+	struct avl_node *node;
+};
+
+/* <0, 0, >0 as the node orders before, equal to, or after key */
+typedef int (*avl_cmp_t)(const struct avl_node *node, const void *key);
+
+#define avl_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline int __avl_height(const struct avl_node *n)
+{
+	return n ? n->height : 0;
+}
+
+static inline void __avl_update(struct avl_node *n)
+{
+	int l = __avl_height(n->left), r = __avl_height(n->right);
+	n->height = (l > r ? l : r) + 1;
+}
+
+static inline void __avl_replace(struct avl_root *root, struct avl_node *parent,
+				 struct avl_node *old, struct avl_node *new)
+{
+	if (parent == NULL)
+		root->node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static inline struct avl_node *__avl_rotate_left(struct avl_root *root,
+						 struct avl_node *x)
+{
+	struct avl_node *y = x->right;
+	x->right = y->left;
+	if (y->left)
+		y->left->parent = x;
+	y->parent = x->parent;
+	__avl_replace(root, x->parent, x, y);
+	y->left = x;
+	x->parent = y;
+	__avl_update(x);
+	__avl_update(y);
+	return y;
+}
+
+static inline struct avl_node *__avl_rotate_right(struct avl_root *root,
+						  struct avl_node *x)
+{
+	struct avl_node *y = x->left;
+	x->left = y->right;
+	if (y->right)
+		y->right->parent = x;
+	y->parent = x->parent;
+	__avl_replace(root, x->parent, x, y);
+	y->right = x;
+	x->parent = y;
+	__avl_update(x);
+	__avl_update(y);
+	return y;
+}
+
+/* restore heights and balance from n up to the root */
+static inline void __avl_fix(struct avl_root *root, struct avl_node *n)
+{
+	while (n) {
+		int bf;
+		__avl_update(n);
+		bf = __avl_height(n->left) - __avl_height(n->right);
+		if (bf > 1) {
+			if (__avl_height(n->left->left) < __avl_height(n->left->right))
+				__avl_rotate_left(root, n->left);
+			n = __avl_rotate_right(root, n);
+		} else if (bf < -1) {
+			if (__avl_height(n->right->right) < __avl_height(n->right->left))
+				__avl_rotate_right(root, n->right);
+			n = __avl_rotate_left(root, n);
+		}
+		n = n->parent;
+	}
+}
+
+static inline void avl_root_init(struct avl_root *root)
+{
+	root->node = NULL;
+}
+
+static inline struct avl_node *avl_find(const struct avl_root *root,
+					const void *key, avl_cmp_t cmp)
+{
+	struct avl_node *n = root->node;
+	while (n) {
+		int c = cmp(n, key);
+		if (c == 0)
+			return n;
+		n = c > 0 ? n->left : n->right;
+	}
+	return NULL;
+}
+
+/* first node that does not order before key (strict: after key) */
+static inline struct avl_node *__avl_bound(const struct avl_root *root,
+					   const void *key, avl_cmp_t cmp,
+					   int strict)
+{
+	struct avl_node *n = root->node, *best = NULL;
+	while (n) {
+		int c = cmp(n, key);
+		if (c > 0 || (c == 0 && !strict)) {
+			best = n;
+			n = n->left;
+		} else
+			n = n->right;
+	}
+	return best;
+}
+
+#define avl_lower_bound(root, key, cmp) __avl_bound(root, key, cmp, 0)
+#define avl_upper_bound(root, key, cmp) __avl_bound(root, key, cmp, 1)
+
+/* returns the existing node instead of inserting when key is already present */
+static inline struct avl_node *avl_insert(struct avl_root *root,
+					  struct avl_node *node,
+					  const void *key, avl_cmp_t cmp)
+{
+	struct avl_node *parent = NULL, **link = &root->node;
+	while (*link) {
+		int c = cmp(*link, key);
+		if (c == 0)
+			return *link;
+		parent = *link;
+		link = c > 0 ? &parent->left : &parent->right;
+	}
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->height = 1;
+	*link = node;
+	__avl_fix(root, parent);
+	return NULL;
+}
+
+static inline void avl_erase(struct avl_root *root, struct avl_node *n)
+{
+	struct avl_node *fix;
+	if (n->left == NULL || n->right == NULL) {
+		struct avl_node *child = n->left ? n->left : n->right;
+		if (child)
+			child->parent = n->parent;
+		__avl_replace(root, n->parent, n, child);
+		fix = n->parent;
+	} else {
+		/* put the in-order successor s in n's place */
+		struct avl_node *s = n->right;
+		while (s->left)
+			s = s->left;
+		if (s->parent == n) {
+			fix = s;
+		} else {
+			fix = s->parent;
+			fix->left = s->right;
+			if (s->right)
+				s->right->parent = fix;
+			s->right = n->right;
+			n->right->parent = s;
+		}
+		s->left = n->left;
+		n->left->parent = s;
+		s->parent = n->parent;
+		__avl_replace(root, n->parent, n, s);
+		s->height = n->height;
+	}
+	__avl_fix(root, fix);
+}
+
+static inline struct avl_node *avl_first(const struct avl_root *root)
+{
+	struct avl_node *n = root->node;
+	if (n)
+		while (n->left)
+			n = n->left;
+	return n;
+}
+
+static inline struct avl_node *avl_next(const struct avl_node *n)
+{
+	if (n->right) {
+		n = n->right;
+		while (n->left)
+			n = n->left;
+		return (struct avl_node *)n;
+	}
+	while (n->parent && n->parent->right == n)
+		n = n->parent;
+	return n->parent;
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/* work-stealing thread pool with per-task futures */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "c_list.h"
+
+/*
+ * Every worker owns a deque of tasks. It takes its own work from the back,
+ * newest first, and when that runs dry it steals the oldest task from the
+ * front of another worker's deque. Tasks submitted from outside the pool are
+ * spread round-robin; tasks submitted by a worker stay on its own deque.
+ * A task is embedded in the caller's job structure and doubles as its
+ * future: pool_wait() returns once fn has run.
+ */
+struct pool_task {
+	struct list_node node;
+	void (*fn)(struct pool_task *);
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct pool;
+
+struct pool_worker {
+	pthread_mutex_t lock;
+	struct list_node tasks;
+	pthread_t tid;
+	struct pool *pool;
+};
+
+struct pool {
+	struct pool_worker *workers;
+	unsigned int nworkers;
+	unsigned int nthreads;	/* workers whose thread did start */
+	unsigned int next;	/* round robin for outside submissions */
+	unsigned int queued;	/* tasks sitting in any deque */
+	int stop;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+};
+
+static __thread struct pool_worker *__pool_self;
+
+static inline struct pool_task *__pool_take(struct pool_worker *w, int steal)
+{
+	struct pool_task *t = NULL;
+	pthread_mutex_lock(&w->lock);
+	if (w->tasks.next != &w->tasks) {
+		struct list_node *n = steal ? w->tasks.next : w->tasks.prev;
+		list_del(n);
+		t = list_entry(n, struct pool_task, node);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return t;
+}
+
+/* own deque first, then the other workers' starting with the next one */
+static inline struct pool_task *__pool_find(struct pool *p, struct pool_worker *self)
+{
+	unsigned int i, me = self ? (unsigned int)(self - p->workers) : 0;
+	struct pool_task *t = self ? __pool_take(self, 0) : NULL;
+	for (i = 1; t == NULL && i <= p->nworkers; i++)
+		t = __pool_take(&p->workers[(me + i) % p->nworkers], 1);
+	if (t != NULL) {
+		pthread_mutex_lock(&p->idle_lock);
+		p->queued--;
+		pthread_mutex_unlock(&p->idle_lock);
+	}
+	return t;
+}
+
+static inline void __pool_run(struct pool_task *t)
+{
+	t->fn(t);
+	pthread_mutex_lock(&t->lock);
+	__atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static inline void *__pool_worker_main(void *arg)
+{
+	struct pool_worker *w = arg;
+	struct pool *p = w->pool;
+	__pool_self = w;
+	for (;;) {
+		struct pool_task *t = __pool_find(p, w);
+		if (t != NULL) {
+			__pool_run(t);
+			continue;
+		}
+		pthread_mutex_lock(&p->idle_lock);
+		while (p->queued == 0 && !p->stop)
+			pthread_cond_wait(&p->idle_cond, &p->idle_lock);
+		if (p->queued == 0 && p->stop) {
+			pthread_mutex_unlock(&p->idle_lock);
+			break;
+		}
+		pthread_mutex_unlock(&p->idle_lock);
+	}
+	return NULL;
+}
+
+/* returns 0 or an errno value; nworkers must be positive */
+static inline int pool_init(struct pool *p, unsigned int nworkers)
+{
+	unsigned int i;
+	p->workers = (struct pool_worker *)calloc(nworkers, sizeof(struct pool_worker));
+	if (p->workers == NULL)
+		return ENOMEM;
+	p->nworkers = nworkers;
+	p->nthreads = 0;
+	p->next = 0;
+	p->queued = 0;
+	p->stop = 0;
+	pthread_mutex_init(&p->idle_lock, NULL);
+	pthread_cond_init(&p->idle_cond, NULL);
+	for (i = 0; i < nworkers; i++) {
+		struct pool_worker *w = &p->workers[i];
+		pthread_mutex_init(&w->lock, NULL);
+		list_init(&w->tasks);
+		w->pool = p;
+	}
+	/*
+	 * workers steal from each other, so all deques exist before any runs;
+	 * the deque of a worker that failed to start is emptied by thieves
+	 */
+	for (i = 0; i < nworkers; i++) {
+		int err = pthread_create(&p->workers[i].tid, NULL, __pool_worker_main,
+					 &p->workers[i]);
+		if (err) {
+			if (i == 0) {
+				free(p->workers);
+				p->workers = NULL;
+				return err;
+			}
+			break;
+		}
+		p->nthreads++;
+	}
+	return 0;
+}
+
+/* runs whatever is still queued, then joins the workers */
+static inline void pool_destroy(struct pool *p)
+{
+	unsigned int i;
+	if (p->workers == NULL)
+		return;
+	pthread_mutex_lock(&p->idle_lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->idle_cond);
+	pthread_mutex_unlock(&p->idle_lock);
+	for (i = 0; i < p->nthreads; i++)
+		pthread_join(p->workers[i].tid, NULL);
+	free(p->workers);
+	p->workers = NULL;
+}
+
+static inline void pool_submit(struct pool *p, struct pool_task *t,
+			       void (*fn)(struct pool_task *))
+{
+	struct pool_worker *w = __pool_self;
+	t->fn = fn;
+	t->done = 0;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	pthread_mutex_lock(&p->idle_lock);
+	if (w == NULL || w->pool != p)
+		w = &p->workers[p->next++ % p->nworkers];
+	pthread_mutex_lock(&w->lock);
+	list_add_prev(&t->node, &w->tasks);
+	pthread_mutex_unlock(&w->lock);
+	p->queued++;
+	pthread_cond_signal(&p->idle_cond);
+	pthread_mutex_unlock(&p->idle_lock);
+}
+
+/*
+ * Wait for t to finish. A worker of the pool keeps running other tasks
+ * meanwhile, so tasks may wait on tasks without starving the pool.
+ */
+static inline void pool_wait(struct pool *p, struct pool_task *t)
+{
+	struct pool_worker *self = __pool_self;
+	if (self != NULL && self->pool == p) {
+		while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+			struct pool_task *o = __pool_find(p, self);
+			if (o != NULL)
+				__pool_run(o);
+			else
+				sched_yield();
+		}
+	}
+	pthread_mutex_lock(&t->lock);
+	while (!t->done)
+		pthread_cond_wait(&t->cond, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+}
+
+#endif
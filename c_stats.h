@@ -0,0 +1,94 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/* log-linear latency histogram in the spirit of HdrHistogram */
+
+#include <stdint.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS) * HIST_SUB + HIST_SUB)
+
+/*
+ * Every bucket keeps HIST_SUB_BITS significant bits of the value, so the
+ * relative error of a reported percentile stays under 1/HIST_SUB.
+ * A histogram has exactly one writer (its owning thread); readers merge
+ * several of them with relaxed loads and accept a slightly stale view.
+ */
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline uint64_t stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline unsigned hist_index(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return (unsigned)v;
+	unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (unsigned)(v >> shift);
+}
+
+static inline uint64_t hist_bucket_low(unsigned idx)
+{
+	if (idx < 2 * HIST_SUB)
+		return idx;
+	unsigned shift = idx / HIST_SUB - 1;
+	return (uint64_t)(idx - shift * HIST_SUB) << shift;
+}
+
+/* single writer: a plain load + relaxed store is enough, no lock prefix */
+#define __hist_bump(p, d) \
+	__atomic_store_n((p), *(p) + (d), __ATOMIC_RELAXED)
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+	__hist_bump(&h->buckets[hist_index(v)], 1);
+	__hist_bump(&h->count, 1);
+	__hist_bump(&h->sum, v);
+	if (v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static inline void hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned i;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum   += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	uint64_t m = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (m > dst->max)
+		dst->max = m;
+}
+
+/* q in [0, 1]; returns the lower bound of the bucket holding the quantile */
+static inline uint64_t hist_quantile(const struct hist *h, double q)
+{
+	uint64_t total = 0, want, seen = 0;
+	unsigned i;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += h->buckets[i];
+	if (total == 0)
+		return 0;
+	want = (uint64_t)(q * total);
+	if (want >= total)
+		want = total - 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want)
+			return hist_bucket_low(i);
+	}
+	return h->max;
+}
+
+#endif
@@ -16,7 +16,54 @@
  *
  * Compile with
  *
- *     gcc -Wall dirSpider.c `pkg-config fuse3 --cflags --libs` -lcspider -I /usr/include/libxml2 -o dirSpider
+ *     gcc -Wall dirSpider.c `pkg-config fuse3 --cflags --libs` -lcspider -lcurl -I /usr/include/libxml2 -o dirSpider
+ *
+ * Per-operation counters and latency percentiles can be read from the
+ * virtual file /.stats inside the mount. Pass --stats-socket=PATH to
+ * also serve them in prometheus text format on a unix socket.
+ * Result files carry where they came from in user.spider.* extended
+ * attributes (query, page, url, fetched_at, result_count, fetch_ms,
+ * cache_hit), e.g. "getfattr -d -m user.spider foo/00".
+ *
+ * Directories list their entries sorted by name; "<dir>/.from/<name>"
+ * lists only the entries of <dir> from <name> on.
+ *
+ * "/.search/<terms>" lists the result files containing all of <terms> as
+ * symlinks to them, answered from an index kept as pages are stored.
+ *
+ * --lazy-mkdir makes mkdir cheap: the first result page is fetched when
+ * "00" is first opened rather than when the directory is made.
+ *
+ * "touch" on a result file re-fetches it with a conditional request;
+ * --refresh-ttl=SECS does the same in the background for every result older
+ * than SECS, at most --refresh-rate=N files a second (default 1). A result
+ * file the user has changed is theirs and never re-fetched.
+ *
+ * Fetches are limited per upstream host by --fetch-inflight=N requests at
+ * once and --fetch-rate=N a second; --fetch-queue, --fetch-timeout and
+ * --fetch-retries bound how long a handler can be held up by upstream.
+ *
+ * --pinned-workers serves requests from a loop of our own with one worker
+ * thread per CPU, each pinned to its core, instead of fuse_main's pool;
+ * --workers=N changes the number of workers. dirSpiderBench -L both
+ * compares the two.
+ *
+ * Pages are parsed on a work-stealing pool of one thread per CPU, or
+ * --pool-threads=N.
+ *
+ * rmdir returns as soon as the directory is unlinked; what was below it is
+ * freed in the background.
+ *
+ * df reports what the tree holds against --capacity-mb=N, by default the
+ * machine's memory; past it, operations that would grow the tree fail with
+ * ENOSPC.
+ *
+ * --search-base=URL replaces the upstream search endpoint, which is how
+ * dirSpiderBench points the daemon at its local mock server.
+ *
+ * --record=FILE keeps every fetched page in an archive; --replay=FILE serves
+ * fetches from one without touching the network, optionally as slow as they
+ * were recorded with --replay-latency=100.
  *
  * ## Source code ##
  * \include passthrough.c
@@ -32,9 +79,12 @@
 #ifdef linux
 /* For pread()/pwrite()/utimensat() */
 #define _XOPEN_SOURCE 700
+/* For CPU_SET()/pthread_setaffinity_np() */
+#define _GNU_SOURCE
 #endif
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -46,989 +96,3666 @@
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
+#ifndef XATTR_CREATE
+#define XATTR_CREATE 1
+#define XATTR_REPLACE 2
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 1
+#endif
 
 #include "c_list.h"
+#include "c_avl.h"
+#include "c_stats.h"
+#include "c_pool.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <cspider/spider.h>
+#include <libxml/parser.h>
+#include <curl/curl.h>
+#include <limits.h>
+#include <strings.h>
 
 #define MAX_NAMELEN 255
 typedef unsigned int uint32_t;
-struct d_inode {
-	char name[MAX_NAMELEN + 1];
-	__uid_t uid;		/* User ID of the file's owner.	*/
-	__gid_t gid;		/* Group ID of the file's group.*/
+
+//**********************************************************************************
+//Inodes
+//
+//Directories, regular files and symlinks share one inode type: a header with
+//everything getattr needs and a payload selected by the type tag. Inodes live
+//in fixed-size chunks of a table indexed by ino, so a lookup by ino is a single
+//probe and walking a tree touches densely packed headers. Names are not part
+//of the inode; a dentry maps a name in a directory to an inode, and hard links
+//are just several dentries sharing one inode.
+//**********************************************************************************
+struct xattr_vec;
+
+enum inode_type {
+	INODE_FREE,
+	INODE_DIR,
+	INODE_FILE,
+	INODE_LINK,
+};
+
+enum lazy_state {
+	LAZY_NONE,	/* contents are whatever was fetched or written */
+	LAZY_PENDING,	/* page not fetched yet, see lazy_fill */
+	LAZY_FETCHING,
+};
+
+struct inode {
+	ino_t ino;
+	unsigned char type;	/* enum inode_type */
 	mode_t mode;
-	struct list_node file_entries;
-	struct list_node dir_entries;
-	struct list_node node;
-	char *link_path;
+	nlink_t nlink;		/* dentries naming this inode */
+	unsigned int nopen;	/* open file handles, which also pin the inode */
+	uid_t uid;		/* User ID of the file's owner.	*/
+	gid_t gid;		/* Group ID of the file's group.*/
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+	struct xattr_vec *xattrs;	/* extended attributes, NULL if none */
+	struct dentry *dentry;	/* its names, newest first, NULL for the root or once gone */
+	union {
+		struct {
+			struct avl_root children;	/* dentries ordered by name */
+			off_t next_cookie;	/* cookie handed to the next child */
+			size_t nchildren;
+			size_t name_bytes;	/* sum of the children's name lengths */
+			ino_t next_reap;	/* next on the teardown queue */
+		} dir;
+		struct {
+			char *contents;
+			size_t size;
+			time_t fetched;	/* last fetch from the search engine, 0 if never */
+			struct list_node refresh;	/* on refresh_queue, next NULL if not */
+			int indexed;	/* contents are in the search index */
+			unsigned char lazy;	/* enum lazy_state */
+			short lazy_err;	/* how the last lazy fetch failed, for its waiters */
+		} file;
+		struct {
+			char *target;
+			size_t len;	/* of target, which is st_size */
+		} link;
+		ino_t next_free;	/* INODE_FREE: next slot on the free list */
+	};
 };
 
-struct f_inode {
-	char name[MAX_NAMELEN + 1];
-	void* contents;
-	__nlink_t nlink;
-	__uid_t uid;		/* User ID of the file's owner.	*/
-	__gid_t gid;		/* Group ID of the file's group.*/
-	size_t size;
-    mode_t mode;
-    struct list_node node;
-    struct list_node* p_node;
-    char *link_path;
+struct dentry {
+	struct avl_node avl;
+	struct inode *inode;
+	struct inode *parent;
+	struct dentry *alias;	/* the next older name of the same inode */
+	off_t cookie;		/* readdir offset inside the parent */
+	char name[];
 };
 
-static struct d_inode *rootDir;
+#define ROOT_INO 1
+#define INODE_CHUNK_BITS 10
+#define INODE_CHUNK (1 << INODE_CHUNK_BITS)
 
-static void *xmp_init(struct fuse_conn_info *conn,
-		      struct fuse_config *cfg)
-{
-	(void) conn;
-	cfg->use_ino = 1;
-	cfg->kernel_cache = 1;
-	cfg->hard_remove = 1;
-	cfg->direct_io = 1;
+static struct inode **inode_chunks;
+static size_t inode_nchunks;
+static ino_t inode_top = ROOT_INO;	/* lowest ino never handed out */
+static ino_t inode_free_head;		/* 0 when the free list is empty */
 
-	return NULL;
+static struct inode *rootDir;
+
+//Guards the whole tree. Most operations hold it for their whole run (see the
+//locked_* entry points); fetches run with it dropped, pinning what they fill.
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static inline struct inode *inode_slot(ino_t ino) {
+	return &inode_chunks[ino >> INODE_CHUNK_BITS][ino & (INODE_CHUNK - 1)];
+}
+
+static struct inode *inode_get(ino_t ino) {
+	if (ino == 0 || (ino >> INODE_CHUNK_BITS) >= inode_nchunks)
+		return NULL;
+	struct inode *i = inode_slot(ino);
+	return i->type == INODE_FREE ? NULL : i;
 }
 
 //**********************************************************************************
-//Don't forget to free name memory
+//Space accounting
+//
+//What the tree holds is counted as it is allocated and freed: live inodes and
+//the bytes behind file contents, names (dentries and link targets), extended
+//attributes and the search index. statfs reports them against a capacity,
+//--capacity-mb or the machine's memory, and operations that would grow the
+//tree past it fail with ENOSPC rather than leave it to the OOM killer.
+//Counters are atomic since pages are laid out off the tree lock.
 //**********************************************************************************
-static int get_parent_inode(const char *path, struct d_inode **p_node, char **name) {
-	char *mpath = (char *)malloc((strlen(path)+1)*sizeof(char));
-	strcpy(mpath, path);
-	char delim[2] = "/";
-	char *last, *next;
-	last = strtok(mpath, delim);
+enum space_kind {
+	SPACE_CONTENTS,
+	SPACE_NAMES,
+	SPACE_XATTRS,
+	SPACE_INDEX,
+	SPACE_KINDS
+};
 
-	struct d_inode *cur_node = rootDir;
-	struct list_node *n;
-	while((next = strtok(NULL, delim))) {
-		int exist = 0;
-		list_for_each (n, &cur_node->dir_entries) {
-			struct d_inode* o = list_entry(n, struct d_inode, node);
-			if(strcmp(o->name, last) == 0) {
-				cur_node = o;
-				exist = 1;
-				break;
-			}
-		}
-		if(exist == 0) {
-			free(mpath);
-			return -ENOENT;
-		}
-		last = next;
-	}
-	*p_node = cur_node;
-	char *target = (char *)malloc((strlen(last)+1)*sizeof(char));
-	strcpy(target, last);
-	*name = target;
-	free(mpath);
-	return 0;
+static const char *space_names[SPACE_KINDS] = {
+	"contents", "names", "xattrs", "index"
+};
+
+static uint64_t space_inodes;
+static uint64_t space_bytes[SPACE_KINDS];
+static uint64_t space_capacity;	/* bytes, set once at startup */
+
+#define space_add(kind, n) \
+	__atomic_add_fetch(&space_bytes[kind], (uint64_t)(n), __ATOMIC_RELAXED)
+#define space_sub(kind, n) \
+	__atomic_sub_fetch(&space_bytes[kind], (uint64_t)(n), __ATOMIC_RELAXED)
+
+static uint64_t space_used(void) {
+	uint64_t used = __atomic_load_n(&space_inodes, __ATOMIC_RELAXED) * sizeof(struct inode);
+	int k;
+	for (k = 0; k < SPACE_KINDS; k++)
+		used += __atomic_load_n(&space_bytes[k], __ATOMIC_RELAXED);
+	return used;
 }
 
-static int xmp_getattr(const char *path, struct stat *st,
-		       struct fuse_file_info *fi)
-{
-	memset(st, 0, sizeof(struct stat));
+//-ENOSPC if more bytes would not fit.
+static int space_check(size_t more) {
+	return space_used() + more > space_capacity ? -ENOSPC : 0;
+}
 
-	if (strcmp(path, "/") == 0) {
-		st->st_mode = 0755 | S_IFDIR;
-		st->st_nlink = 2;
-		st->st_size = 0;
-		struct list_node* n;
-		list_for_each (n, &rootDir->file_entries) {
-			struct f_inode* o = list_entry(n, struct f_inode, node);
-			++st->st_nlink;
-			st->st_size += strlen(o->name);
-		}
-		list_for_each (n, &rootDir->dir_entries) {
-			struct d_inode* o = list_entry(n, struct d_inode, node);
-			++st->st_nlink;
-			st->st_size += strlen(o->name);
+//**********************************************************************************
+//Directory membership
+//
+//Every directory indexes its dentries by name, which gives O(log n) lookups
+//and lets readdir return entries sorted. Children also get a cookie from their
+//parent's counter when they are linked in; it is the readdir offset reported
+//for them and is never reused, so an offset handed out earlier stays
+//meaningful however the directory changes.
+//Offsets 1 and 2 belong to "." and "..", 3 and 4 to the root's stats file
+//and search directory.
+//**********************************************************************************
+#define COOKIE_DOT      1
+#define COOKIE_DOTDOT   2
+#define COOKIE_STATS    3
+#define COOKIE_SEARCH   4
+#define COOKIE_FIRST    5
+
+static struct inode *inode_alloc(enum inode_type type, mode_t mode) {
+	struct inode *i;
+	if (inode_free_head != 0) {
+		i = inode_slot(inode_free_head);
+		inode_free_head = i->next_free;
+	} else {
+		if ((inode_top >> INODE_CHUNK_BITS) >= inode_nchunks) {
+			struct inode **chunks = (struct inode **)realloc(inode_chunks,
+					(inode_nchunks + 1) * sizeof(struct inode *));
+			if (chunks == NULL)
+				return NULL;
+			inode_chunks = chunks;
+			chunks[inode_nchunks] = (struct inode *)calloc(INODE_CHUNK, sizeof(struct inode));
+			if (chunks[inode_nchunks] == NULL)
+				return NULL;
+			inode_nchunks++;
 		}
-		return 0;
+		i = inode_slot(inode_top);
+		i->ino = inode_top++;
+	}
+	ino_t ino = i->ino;
+	__atomic_add_fetch(&space_inodes, 1, __ATOMIC_RELAXED);
+	memset(i, 0, sizeof(struct inode));
+	i->ino = ino;
+	i->type = type;
+	i->mode = mode;
+	clock_gettime(CLOCK_REALTIME, &i->mtime);
+	i->atime = i->ctime = i->mtime;
+	if (type == INODE_DIR) {
+		avl_root_init(&i->dir.children);
+		i->dir.next_cookie = COOKIE_FIRST;
 	}
+	return i;
+}
 
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
-	struct list_node* n;
-	list_for_each (n, &ptdir_inode->dir_entries) {
-		struct d_inode* d_o = list_entry(n, struct d_inode, node);
-		if(strcmp(d_o->name, name) == 0) {
-			st->st_mode = d_o->mode;
-			st->st_uid = d_o->uid;
-			st->st_gid = d_o->gid;
-			if((d_o->mode & S_IFLNK) == S_IFLNK) {
-				st->st_nlink = 1;
-				st->st_size = 1;
-				free(name);
-				return 0;
-			}
-			st->st_nlink = 2;
-			st->st_size = 0;
-			list_for_each (n, &d_o->file_entries) {
-				struct f_inode* o = list_entry(n, struct f_inode, node);
-				++st->st_nlink;
-				st->st_size += strlen(o->name);
-			}
-			list_for_each (n, &d_o->dir_entries) {
-				struct d_inode* o = list_entry(n, struct d_inode, node);
-				++st->st_nlink;
-				st->st_size += strlen(o->name);
-			}
-			free(name);
-			return 0;
-		}
+//**********************************************************************************
+//File contents
+//
+//A file's contents live in a reference-counted buffer with spare capacity
+//behind it; file.contents points at its data. Capacity is what fallocate
+//reserves and what appends grow geometrically, so neither reallocs per
+//write. copy_file_range of a whole file shares the source's buffer instead of
+//copying it, and whoever writes to a shared buffer first copies it for
+//itself. Reference counts change under the tree write lock.
+//**********************************************************************************
+struct content {
+	unsigned int refs;	/* files sharing it; only written once unshared */
+	size_t cap;
+	char data[];
+};
+
+#define content_of(p) container_of(p, struct content, data)
+
+static char *content_alloc(size_t cap) {
+	struct content *c = (struct content *)malloc(sizeof(struct content) + cap);
+	if (c == NULL)
+		return NULL;
+	c->refs = 1;
+	c->cap = cap;
+	space_add(SPACE_CONTENTS, sizeof(struct content) + cap);
+	return c->data;
+}
+
+static void content_put(char *data) {
+	if (data != NULL && --content_of(data)->refs == 0) {
+		space_sub(SPACE_CONTENTS, sizeof(struct content) + content_of(data)->cap);
+		free(content_of(data));
 	}
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode* f_o = list_entry(n, struct f_inode, node);
-		if(strcmp(f_o->name, name) == 0) {
-			st->st_uid = f_o->uid;
-			st->st_gid = f_o->gid;
-			if(f_o->p_node != NULL)
-				f_o = list_entry(f_o->p_node, struct f_inode, node);
-			st->st_mode = f_o->mode;
-			if((f_o->mode & S_IFLNK) == S_IFLNK) {
-				st->st_nlink = 1;
-				st->st_size = 1;
-				free(name);
-				return 0;
-			}
-			st->st_nlink = f_o->nlink;
-			st->st_size = f_o->size;
-			free(name);
-			return 0;
-		}
+}
+
+static void content_share(struct inode *to, struct inode *from) {
+	content_put(to->file.contents);
+	to->file.contents = from->file.contents;
+	to->file.size = from->file.size;
+	if (to->file.contents != NULL)
+		content_of(to->file.contents)->refs++;
+}
+
+//Make the contents of i its own, with room for at least need bytes. With
+//grow, a buffer that has to move gets twice the old capacity if that is more
+//and still fits. -ENOSPC if what would be allocated doesn't fit.
+static int content_reserve(struct inode *i, size_t need, int grow) {
+	struct content *c = i->file.contents ? content_of(i->file.contents) : NULL;
+	size_t cap = c != NULL ? c->cap : 0;
+	if (c != NULL && c->refs == 1 && cap >= need)
+		return 0;
+	if (need < i->file.size)
+		need = i->file.size;
+	//a buffer of our own grows in place, a shared one is copied whole
+	size_t have = c != NULL && c->refs == 1 ? cap : 0;
+	if (space_check(need - have) != 0)
+		return -ENOSPC;
+	if (grow && cap * 2 > need && space_check(cap * 2 - have) == 0)
+		need = cap * 2;
+	if (c != NULL && c->refs == 1) {
+		c = (struct content *)realloc(c, sizeof(struct content) + need);
+		if (c == NULL)
+			return -ENOMEM;
+		space_add(SPACE_CONTENTS, need - c->cap);
+		c->cap = need;
+		i->file.contents = c->data;
+		return 0;
 	}
-	free(name);
-	return -ENOENT;
+	char *data = content_alloc(need);
+	if (data == NULL)
+		return -ENOMEM;
+	if (i->file.size != 0)
+		memcpy(data, i->file.contents, i->file.size);
+	content_put(i->file.contents);
+	i->file.contents = data;
+	return 0;
 }
 
-static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi,
-		       enum fuse_readdir_flags flags)
-{
-	filler(buf, ".", NULL, 0, 0);
-	filler(buf, "..", NULL, 0, 0);
-
-	struct list_node* n;
-	if(strcmp(path, "/") == 0) {
-		list_for_each (n, &rootDir->file_entries) {
-			struct f_inode* o = list_entry(n, struct f_inode, node);
-			filler(buf, o->name, NULL, 0, 0);
-		}
-		list_for_each (n, &rootDir->dir_entries) {
-			struct d_inode* o = list_entry(n, struct d_inode, node);
-			filler(buf, o->name, NULL, 0, 0);
+//Set the size of i, zero-filling what it grows by. A buffer left more than
+//half empty by shrinking is cut down to size.
+static int content_resize(struct inode *i, size_t size) {
+	size_t old = i->file.size;
+	if (size > old) {
+		int err = content_reserve(i, size, 0);
+		if (err)
+			return err;
+		memset(i->file.contents + old, 0, size - old);
+	} else if (size == 0) {
+		content_put(i->file.contents);
+		i->file.contents = NULL;
+	} else if (content_of(i->file.contents)->refs == 1 &&
+		   size <= content_of(i->file.contents)->cap / 2) {
+		struct content *c = (struct content *)realloc(content_of(i->file.contents),
+							      sizeof(struct content) + size);
+		if (c != NULL) {
+			space_sub(SPACE_CONTENTS, c->cap - size);
+			c->cap = size;
+			i->file.contents = c->data;
 		}
-		return 0;
 	}
+	i->file.size = size;
+	return 0;
+}
 
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
+static void index_remove(struct inode *i);
+static void refresh_dequeue(struct inode *i);
+static void xattr_free(struct xattr_vec *v);
 
-	struct d_inode *target_inode;
-	list_for_each (n, &ptdir_inode->dir_entries) {
-		struct d_inode* o = list_entry(n, struct d_inode, node);
-		if(strcmp(o->name, name) == 0) {
-			target_inode = o;
-			break;
-		}
+static void inode_release(struct inode *i) {
+	if (i->type == INODE_FILE) {
+		index_remove(i);
+		refresh_dequeue(i);
 	}
-	if(target_inode == NULL) {
-		free(name);
-		return -ENOENT;
+	xattr_free(i->xattrs);
+	i->xattrs = NULL;
+	if (i->type == INODE_FILE)
+		content_put(i->file.contents);
+	else if (i->type == INODE_LINK && i->link.target != NULL) {
+		space_sub(SPACE_NAMES, i->link.len + 1);
+		free(i->link.target);
 	}
+	__atomic_sub_fetch(&space_inodes, 1, __ATOMIC_RELAXED);
+	i->type = INODE_FREE;
+	i->next_free = inode_free_head;
+	inode_free_head = i->ino;
+}
+
+static void inode_touch(struct inode *i, int modified) {
+	clock_gettime(CLOCK_REALTIME, &i->ctime);
+	if (modified)
+		i->mtime = i->ctime;
+}
+
+//**********************************************************************************
+//Extended attributes
+//
+//All attributes of an inode are packed into one growable buffer: a short
+//header per entry followed by the name and the value, no terminators. Inodes
+//without attributes pay one NULL pointer, and adding an attribute is at most
+//one realloc of the whole vector.
+//**********************************************************************************
+#define XATTR_NAME_LEN 255
+#define XATTR_VALUE_LEN 65535
+#define XATTR_SPIDER "user.spider."
+
+struct xattr_ent {
+	uint8_t name_len;
+	uint16_t value_len;
+} __attribute__((packed));
+
+struct xattr_vec {
+	uint32_t used;
+	uint32_t cap;
+	char data[];
+};
 
-	list_for_each (n, &target_inode->dir_entries) {
-		struct d_inode* o = list_entry(n, struct d_inode, node);
-		filler(buf, o->name, NULL, 0, 0);
+#define xattr_ent_size(e) (sizeof(struct xattr_ent) + (e)->name_len + (e)->value_len)
+#define xattr_ent_name(e) ((char *)(e) + sizeof(struct xattr_ent))
+#define xattr_ent_value(e) (xattr_ent_name(e) + (e)->name_len)
+
+static struct xattr_ent *xattr_find(struct xattr_vec *v, const char *name) {
+	if (v == NULL)
+		return NULL;
+	size_t len = strlen(name);
+	uint32_t off = 0;
+	while (off < v->used) {
+		struct xattr_ent *e = (struct xattr_ent *)(v->data + off);
+		if (e->name_len == len && memcmp(xattr_ent_name(e), name, len) == 0)
+			return e;
+		off += xattr_ent_size(e);
 	}
-	list_for_each (n, &target_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		filler(buf, o->name, NULL, 0, 0);
+	return NULL;
+}
+
+static void xattr_del(struct xattr_vec *v, struct xattr_ent *e) {
+	char *end = (char *)e + xattr_ent_size(e);
+	memmove(e, end, v->data + v->used - end);
+	v->used -= end - (char *)e;
+}
+
+static int xattr_set(struct xattr_vec **vp, const char *name, const char *value,
+		     size_t size, int flags) {
+	size_t len = strlen(name);
+	if (len > XATTR_NAME_LEN)
+		return -ERANGE;
+	if (size > XATTR_VALUE_LEN)
+		return -E2BIG;
+	struct xattr_ent *e = xattr_find(*vp, name);
+	if (e != NULL && (flags & XATTR_CREATE))
+		return -EEXIST;
+	if (e == NULL && (flags & XATTR_REPLACE))
+		return -ENODATA;
+
+	uint32_t used = (*vp ? (*vp)->used : 0) - (e ? xattr_ent_size(e) : 0);
+	uint32_t need = used + sizeof(struct xattr_ent) + len + size;
+	if (*vp == NULL || need > (*vp)->cap) {
+		uint32_t cap = *vp ? (*vp)->cap : 0;
+		if (cap < 128)
+			cap = 128;
+		while (cap < need)
+			cap *= 2;
+		struct xattr_vec *v = (struct xattr_vec *)realloc(*vp, sizeof(struct xattr_vec) + cap);
+		if (v == NULL)
+			return -ENOMEM;
+		if (*vp == NULL) {
+			v->used = 0;
+			v->cap = 0;
+			space_add(SPACE_XATTRS, sizeof(struct xattr_vec));
+		}
+		space_add(SPACE_XATTRS, cap - v->cap);
+		v->cap = cap;
+		*vp = v;
+		e = xattr_find(v, name);
 	}
-	free(name);
+	if (e != NULL)
+		xattr_del(*vp, e);
+
+	e = (struct xattr_ent *)((*vp)->data + (*vp)->used);
+	e->name_len = len;
+	e->value_len = size;
+	memcpy(xattr_ent_name(e), name, len);
+	memcpy(xattr_ent_value(e), value, size);
+	(*vp)->used += xattr_ent_size(e);
 	return 0;
 }
 
-#define SPIDER_LENGTH 100
-static char *spider_title[SPIDER_LENGTH];
-static char *spider_url[SPIDER_LENGTH];
-static int spider_title_size = 0;
-static int spider_url_size = 0;
+static void xattr_free(struct xattr_vec *v) {
+	if (v != NULL) {
+		space_sub(SPACE_XATTRS, sizeof(struct xattr_vec) + v->cap);
+		free(v);
+	}
+}
 
-static char *join_with_base(char *wd, char* pn) {
-	char *url_base = "http://www.baidu.com/s";
-	char *result = malloc((
-			strlen(url_base) +
-			strlen("?wd=") +
-			strlen(wd) +
-			strlen("&pn=") +
-			strlen(pn) + 1)*sizeof(char));
-	strcpy(result, url_base);
-	strcat(result, "?wd=");
-	strcat(result, wd);
-	strcat(result, "&pn=");
-	strcat(result, pn);
-	return result;
+static int xattr_set_str(struct xattr_vec **vp, const char *name, const char *value) {
+	return xattr_set(vp, name, value, strlen(value), 0);
 }
 
-static void process(cspider_t *cspider, char *d, char *url, void *user_data) {
-	int i;
-	for(i=0; i<spider_url_size; i++) {
-		free(spider_url[i]);
-	}
-	spider_url_size = 0;
-	for(i=0; i<spider_title_size; i++) {
-		free(spider_title[i]);
-	}
-	spider_title_size = 0;
-	spider_url_size   = xpath(d, "//div[@id='content_left']//h3/a/@href", spider_url, SPIDER_LENGTH);
-	spider_title_size = xpath(d, "//div[@id='content_left']//h3/a", spider_title, SPIDER_LENGTH);
+#define dentry_of(n) avl_entry(n, struct dentry, avl)
+
+static int dentry_cmp(const struct avl_node *n, const void *key) {
+	return strcmp(dentry_of(n)->name, (const char *)key);
 }
 
-static void save(void *str, void *user_data) {
-	return;
+static struct dentry *dir_find(struct inode *dir, const char *name) {
+	struct avl_node *n = avl_find(&dir->dir.children, name, dentry_cmp);
+	return n ? dentry_of(n) : NULL;
 }
 
-static int xmp_mkdir(const char *path, mode_t mode)
-{
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
+//A name inside a longer string, e.g. one component of a path.
+struct name_ref {
+	const char *s;
+	size_t len;
+};
 
-	if (strlen(name) > MAX_NAMELEN) {
-		free(name);
-		return -ENAMETOOLONG;
-	}
+static int dentry_cmp_ref(const struct avl_node *n, const void *key) {
+	const struct name_ref *r = (const struct name_ref *)key;
+	const char *name = dentry_of(n)->name;
+	int c = strncmp(name, r->s, r->len);
+	return c != 0 ? c : (unsigned char)name[r->len];
+}
 
-	struct list_node* n;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			free(name);
-			return -EEXIST;
-		}
-	}
-	list_for_each (n, &ptdir_inode->dir_entries) {
-		struct d_inode* o = list_entry(n, struct d_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			free(name);
-			return -EEXIST;
-		}
-	}
+//dir_find for the len bytes at name, which need not be NUL-terminated
+static struct dentry *dir_find_n(struct inode *dir, const char *name, size_t len) {
+	struct name_ref r = { name, len };
+	struct avl_node *n = avl_find(&dir->dir.children, &r, dentry_cmp_ref);
+	return n ? dentry_of(n) : NULL;
+}
 
-	struct d_inode* d_o = (struct d_inode *)malloc(sizeof(struct d_inode));
-	strcpy(d_o->name, name);
-	free(name);
-	d_o->mode = mode | 0755 | S_IFDIR;
-	list_init(&d_o->file_entries);
-	list_init(&d_o->dir_entries);
-	list_add_prev(&d_o->node, &ptdir_inode->dir_entries);
+//first child whose name sorts at or after name (strictly after if strict)
+static struct dentry *dir_seek(struct inode *dir, const char *name, int strict) {
+	struct avl_node *n = strict ? avl_upper_bound(&dir->dir.children, name, dentry_cmp)
+				    : avl_lower_bound(&dir->dir.children, name, dentry_cmp);
+	return n ? dentry_of(n) : NULL;
+}
 
+static struct dentry *dir_next(struct dentry *e) {
+	struct avl_node *n = avl_next(&e->avl);
+	return n ? dentry_of(n) : NULL;
+}
 
-	char *wd  = (char *)malloc((strlen(path)+1)*sizeof(char));
-	char *buf = (char *)malloc((strlen(path)+1)*sizeof(char));
-	strcpy(buf, path);
-	char delim[2] = "/";
-	char *p = strtok(buf, delim);
-	strcpy(wd, p);
-	while((p = strtok(NULL, delim))) {
-		strcat(wd, "+");
-		strcat(wd, p);
-	}
-	free(buf);
+//Add a dentry for i under name; takes a link on i.
+static struct dentry *dir_link(struct inode *dir, const char *name, struct inode *i) {
+	size_t len = strlen(name);
+	struct dentry *e = (struct dentry *)malloc(sizeof(struct dentry) + len + 1);
+	if (e == NULL)
+		return NULL;
+	space_add(SPACE_NAMES, sizeof(struct dentry) + len + 1);
+	memcpy(e->name, name, len + 1);
+	e->inode = i;
+	e->parent = dir;
+	e->cookie = dir->dir.next_cookie++;
+	avl_insert(&dir->dir.children, &e->avl, e->name, dentry_cmp);
+	dir->dir.nchildren++;
+	dir->dir.name_bytes += len;
+	i->nlink++;
+	e->alias = i->dentry;
+	i->dentry = e;
+	inode_touch(dir, 1);
+	return e;
+}
 
-	// Initialize CSpider
-	cspider_t *spider = init_cspider();
-	char *agent = "Mozilla/5.0 (Macintosh; Intel Mac OS X 10.10; rv:42.0) Gecko/20100101 Firefox/42.0";
-	char *pn = "00";
-	char *url = join_with_base(wd, pn);
-	cs_setopt_url(spider, url);
-	cs_setopt_useragent(spider, agent);
-	cs_setopt_process(spider, process, NULL);
-	cs_setopt_save(spider, save, NULL);
-	//cs_setopt_logfile(spider, stdout);
-	cs_setopt_threadnum(spider, 5);
-	cs_run(spider);
-	free(wd);
+//Take e off the names of its inode; there is more than one only for hard
+//linked files.
+static void dentry_unalias(struct dentry *e) {
+	struct dentry **p = &e->inode->dentry;
+	while (*p != e)
+		p = &(*p)->alias;
+	*p = e->alias;
+}
 
-	struct f_inode *f_o = (struct f_inode *)malloc(sizeof(struct f_inode));
-	strcpy(f_o->name, "00");
-	f_o->size = 0;
-	f_o->mode = S_IFREG | 0644;
-	f_o->nlink = 1;
-
-	if(spider_title_size != 0 && spider_title != NULL && spider_title[0]!=NULL && spider_url != NULL && spider_url != NULL) {
-		int i=0;
-		int content_size = 0;
-		for(i=0; i<spider_title_size; i++) {
-			content_size += strlen(spider_title[i]) + strlen("\n");
-			content_size += strlen(spider_url[i]) + strlen("\n");
-		}
+//Remove e from dir and free it; the caller drops the link with inode_put.
+static struct inode *dir_unlink(struct inode *dir, struct dentry *e) {
+	struct inode *i = e->inode;
+	dentry_unalias(e);
+	avl_erase(&dir->dir.children, &e->avl);
+	dir->dir.nchildren--;
+	dir->dir.name_bytes -= strlen(e->name);
+	inode_touch(dir, 1);
+	space_sub(SPACE_NAMES, sizeof(struct dentry) + strlen(e->name) + 1);
+	free(e);
+	return i;
+}
 
-		char *contents = (char *)malloc(content_size + 1);
-		strcpy(contents, spider_title[0]);
-		strcat(contents, "\n");
-		strcat(contents, spider_url[0]);
-		strcat(contents, "\n");
-
-		for(i=1; i<spider_title_size; i++) {
-			strcat(contents, spider_title[i]);
-			strcat(contents, "\n");
-			strcat(contents, spider_url[i]);
-			strcat(contents, "\n");
-		}
+static void inode_destroy(struct inode *i);
+static void reap_push(struct inode *dir);
 
-		f_o->size = strlen(contents);
-		f_o->contents = contents;
-	}
+//Drop one link; the last one frees the inode and, for a directory, everything
+//below it. An inode that is still open or pinned goes when it is unpinned.
+static void inode_put(struct inode *i) {
+	if (--i->nlink == 0 && i->nopen == 0)
+		inode_destroy(i);
+}
 
-	list_add_prev(&f_o->node, &d_o->file_entries);
+//Pins keep an inode alive across a dropped tree lock; taking one only needs
+//the read lock, dropping one needs the write lock.
+static void inode_pin(struct inode *i) {
+	__atomic_add_fetch(&i->nopen, 1, __ATOMIC_RELAXED);
+}
 
-	return 0;
+static void inode_unpin(struct inode *i) {
+	if (--i->nopen == 0 && i->nlink == 0)
+		inode_destroy(i);
 }
 
-static int xmp_unlink(const char *path)
-{
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
+//A directory with children is handed to the teardown queue rather than
+//emptied here, however big or deep it is.
+static void inode_destroy(struct inode *i) {
+	if (i->type == INODE_DIR && i->dir.children.node != NULL)
+		reap_push(i);
+	else
+		inode_release(i);
+}
 
-	struct list_node *n, *p;
-	list_for_each_safe (n, p, &ptdir_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			__list_del(n);
-			if(o->p_node != NULL) {
-				struct f_inode* p_o = list_entry(o->p_node, struct f_inode, node);
-				p_o->nlink--;
-				if(p_o->nlink == 0)
-					free(p_o);
-				free(o);
-			} else {
-				o->nlink--;
-				if(o->nlink == 0)
-					free(o);
-			}
-			free(name);
+//**********************************************************************************
+//Teardown
+//
+//Removing a directory unlinks it and queues it; what is below it is freed
+//afterwards by a reaper thread, REAP_BATCH dentries per hold of the write
+//lock, so rmdir of a huge tree returns at once and other operations keep
+//going in between. Teardown never recurses: children are peeled off the
+//directory's name index leaf by leaf, files and links go back to the inode
+//free list with their contents, and a child directory whose last link goes
+//is queued in turn. Without the reaper (before init, or at unmount) the
+//queue is drained inline.
+//**********************************************************************************
+#define REAP_BATCH 4096
+
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_cond = PTHREAD_COND_INITIALIZER;
+static ino_t reap_head;		/* queued directories, 0 when none */
+static ino_t reap_cur;		/* directory being emptied, 0 when none */
+static int reap_stop;
+static int reap_running;	/* the reaper thread is up */
+static int reap_draining;	/* an inline drain is under way */
+static pthread_t reap_tid;
+
+//Free up to limit dentries of queued directories, all of them if limit is 0.
+//Called with the tree write-locked. Returns nonzero while work is left.
+static int reap_run(size_t limit) {
+	size_t done = 0;
+	for (;;) {
+		pthread_mutex_lock(&reap_lock);
+		if (reap_cur == 0 && reap_head != 0) {
+			reap_cur = reap_head;
+			reap_head = inode_slot(reap_cur)->dir.next_reap;
+		}
+		ino_t ino = reap_cur;
+		pthread_mutex_unlock(&reap_lock);
+		if (ino == 0)
 			return 0;
+
+		struct inode *dir = inode_slot(ino);
+		struct avl_node *n = dir->dir.children.node;
+		while (n != NULL) {
+			if (limit != 0 && done == limit)
+				return 1;
+			while (n->left != NULL || n->right != NULL)
+				n = n->left != NULL ? n->left : n->right;
+			struct avl_node *parent = n->parent;
+			if (parent == NULL)
+				dir->dir.children.node = NULL;
+			else if (parent->left == n)
+				parent->left = NULL;
+			else
+				parent->right = NULL;
+			struct dentry *e = dentry_of(n);
+			dentry_unalias(e);
+			inode_put(e->inode);
+			space_sub(SPACE_NAMES, sizeof(struct dentry) + strlen(e->name) + 1);
+			free(e);
+			done++;
+			n = parent;
 		}
+		inode_release(dir);
+		pthread_mutex_lock(&reap_lock);
+		reap_cur = 0;
+		pthread_mutex_unlock(&reap_lock);
 	}
-	free(name);
-	return -ENOENT;
 }
 
-static void free_dir_node(struct d_inode *d_node) {
-	struct list_node *n, *p;
-	list_for_each_safe (n, p, &d_node->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		__list_del(n);
-		free(o);
+static void reap_push(struct inode *dir) {
+	pthread_mutex_lock(&reap_lock);
+	dir->dir.next_reap = reap_head;
+	reap_head = dir->ino;
+	pthread_cond_signal(&reap_cond);
+	pthread_mutex_unlock(&reap_lock);
+	if (!reap_running && !reap_draining) {
+		reap_draining = 1;
+		reap_run(0);
+		reap_draining = 0;
 	}
-	list_for_each_safe (n, p, &d_node->dir_entries) {
-		struct d_inode* o = list_entry(n, struct d_inode, node);
-		free_dir_node(o);
+}
+
+static void *reap_loop(void *arg) {
+	for (;;) {
+		pthread_mutex_lock(&reap_lock);
+		while (reap_head == 0 && reap_cur == 0 && !reap_stop)
+			pthread_cond_wait(&reap_cond, &reap_lock);
+		int stop = reap_stop;
+		pthread_mutex_unlock(&reap_lock);
+		if (stop)
+			return NULL;
+		pthread_rwlock_wrlock(&tree_lock);
+		reap_run(REAP_BATCH);
+		pthread_rwlock_unlock(&tree_lock);
 	}
-	free(d_node);
-	return;
 }
 
-static int xmp_rmdir(const char *path)
-{
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
+static int reap_start(void) {
+	int err = pthread_create(&reap_tid, NULL, reap_loop, NULL);
+	if (err)
+		return -err;
+	reap_running = 1;
+	return 0;
+}
 
-	struct list_node *n, *p;
-	list_for_each_safe (n, p, &ptdir_inode->dir_entries) {
-		struct d_inode* o = list_entry(n, struct d_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			__list_del(n);
-			free_dir_node(o);
-			return 0;
-		}
-	}
-	return -ENOENT;
+//Whatever is still queued is left for an inline drain.
+static void reap_end(void) {
+	if (!reap_running)
+		return;
+	pthread_mutex_lock(&reap_lock);
+	reap_stop = 1;
+	pthread_cond_signal(&reap_cond);
+	pthread_mutex_unlock(&reap_lock);
+	pthread_join(reap_tid, NULL);
+	reap_running = 0;
 }
 
-static int xmp_create(const char *path, mode_t mode,
-		      struct fuse_file_info *fi)
-{
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
+//**********************************************************************************
+//Search index
+//
+//An inverted index from every term in the fetched result files to the sorted
+//inos of the files containing it. It is kept up to date as pages are stored,
+//refreshed and dropped, so "/.search/<terms>" is answered by intersecting a
+//few posting lists rather than by reading every file. Terms are runs of
+//letters and digits, lowercased, at least INDEX_TERM_MIN bytes long; bytes
+//above 0x7f count as letters, so UTF-8 words stay whole. A query is split the
+//same way and matches the files containing all of its terms.
+//**********************************************************************************
+#define INDEX_TERM_MIN 2
+#define INDEX_TERM_MAX 64
+#define INDEX_QUERY_TERMS (MAX_NAMELEN / (INDEX_TERM_MIN + 1) + 1)
+
+struct index_term {
+	struct avl_node avl;
+	ino_t *inos;		/* ascending */
+	size_t n, cap;
+	char name[];
+};
 
-	if (strlen(name) > MAX_NAMELEN)
-		return -ENAMETOOLONG;
+static struct avl_root search_index;
 
-	struct list_node *n;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0)
-			return -EEXIST;
+#define index_term_of(n) avl_entry(n, struct index_term, avl)
+
+static int index_term_cmp(const struct avl_node *n, const void *key) {
+	return strcmp(index_term_of(n)->name, (const char *)key);
+}
+
+static int index_term_char(unsigned char c) {
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+	       (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+//Copy the next term of [p, end) into term, lowercased and cut at
+//INDEX_TERM_MAX bytes. Returns where to continue, NULL when there is none.
+static const char *index_next_term(const char *p, const char *end, char *term) {
+	for (;;) {
+		while (p < end && !index_term_char(*p))
+			p++;
+		if (p == end)
+			return NULL;
+		size_t len = 0;
+		for (; p < end && index_term_char(*p); p++)
+			if (len < INDEX_TERM_MAX)
+				term[len++] = *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p;
+		term[len] = '\0';
+		if (len >= INDEX_TERM_MIN)
+			return p;
 	}
+}
 
-	list_for_each (n, &ptdir_inode->dir_entries) {
-		struct d_inode *o = list_entry(n, struct d_inode, node);
-		if (strcmp(name, o->name) == 0)
-			return -EEXIST;
+//Position of the first posting >= ino.
+static size_t index_bound(const struct index_term *t, ino_t ino) {
+	size_t lo = 0, hi = t->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (t->inos[mid] < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
 
-	struct f_inode *f_o = (struct f_inode *)malloc(sizeof(struct f_inode));
-	strcpy(f_o->name, name);
-	f_o->size = 0;
-	f_o->mode = mode | S_IFREG | 0644;
-	f_o->nlink = 1;
+static int index_has(const struct index_term *t, ino_t ino) {
+	size_t k = index_bound(t, ino);
+	return k < t->n && t->inos[k] == ino;
+}
 
-	if(ptdir_inode != rootDir) {
-		char *wd  = (char *)malloc((strlen(path)+1)*sizeof(char));
-		char *buf = (char *)malloc((strlen(path)+1)*sizeof(char));
-		strcpy(buf, path);
-		char delim[2] = "/";
-		char *last, *next;
-		last= strtok(buf, delim);
-		strcpy(wd, last);
-		last = strtok(NULL, delim);
-		while((next = strtok(NULL, delim))) {
-			strcat(wd, "+");
-			strcat(wd, last);
-			last = next;
-		}
-		free(buf);
-		cspider_t *spider = init_cspider();
-		char *agent = "Mozilla/5.0 (Macintosh; Intel Mac OS X 10.10; rv:42.0) Gecko/20100101 Firefox/42.0";
-		char *url = join_with_base(wd, name);
-		cs_setopt_url(spider, url);
-		cs_setopt_useragent(spider, agent);
-		cs_setopt_process(spider, process, NULL);
-		cs_setopt_save(spider, save, NULL);
-		cs_setopt_threadnum(spider, 5);
-		cs_run(spider);
-		free(wd);
-		int i=0;
-		int content_size = 0;
-		for(i=0; i<spider_title_size; i++) {
-			content_size += strlen(spider_title[i]) + strlen("\n");
-			content_size += strlen(spider_url[i]) + strlen("\n");
-		}
-		char *contents = (char *)malloc(content_size + 1);
-		strcpy(contents, spider_title[0]);
-		strcat(contents, "\n");
-		strcat(contents, spider_url[0]);
-		strcat(contents, "\n");
-		for(i=1; i<spider_title_size; i++) {
-			strcat(contents, spider_title[i]);
-			strcat(contents, "\n");
-			strcat(contents, spider_url[i]);
-			strcat(contents, "\n");
-		}
-		f_o->contents = contents;
-		f_o->size = strlen(contents);
+static void index_term_add(const char *name, ino_t ino) {
+	struct avl_node *n = avl_find(&search_index, name, index_term_cmp);
+	struct index_term *t;
+	if (n != NULL)
+		t = index_term_of(n);
+	else {
+		size_t len = strlen(name);
+		t = (struct index_term *)calloc(1, sizeof(struct index_term) + len + 1);
+		if (t == NULL)
+			return;
+		space_add(SPACE_INDEX, sizeof(struct index_term) + len + 1);
+		memcpy(t->name, name, len + 1);
+		avl_insert(&search_index, &t->avl, t->name, index_term_cmp);
 	}
+	size_t k = index_bound(t, ino);
+	if (k < t->n && t->inos[k] == ino)
+		return;
+	if (t->n == t->cap) {
+		size_t cap = t->cap ? t->cap * 2 : 4;
+		ino_t *inos = (ino_t *)realloc(t->inos, cap * sizeof(ino_t));
+		if (inos == NULL)
+			return;
+		space_add(SPACE_INDEX, (cap - t->cap) * sizeof(ino_t));
+		t->inos = inos;
+		t->cap = cap;
+	}
+	memmove(t->inos + k + 1, t->inos + k, (t->n - k) * sizeof(ino_t));
+	t->inos[k] = ino;
+	t->n++;
+}
 
-	list_add_prev(&f_o->node, &ptdir_inode->file_entries);
-	free(name);
-	return 0;
+static void index_term_del(const char *name, ino_t ino) {
+	struct avl_node *n = avl_find(&search_index, name, index_term_cmp);
+	if (n == NULL)
+		return;
+	struct index_term *t = index_term_of(n);
+	size_t k = index_bound(t, ino);
+	if (k == t->n || t->inos[k] != ino)
+		return;
+	memmove(t->inos + k, t->inos + k + 1, (t->n - k - 1) * sizeof(ino_t));
+	if (--t->n == 0) {
+		avl_erase(&search_index, &t->avl);
+		space_sub(SPACE_INDEX, sizeof(struct index_term) + strlen(t->name) + 1 +
+			  t->cap * sizeof(ino_t));
+		free(t->inos);
+		free(t);
+	}
 }
 
-static int xmp_open(const char *path, struct fuse_file_info *fi)
-{
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
+//Index the contents of result file i. Called with the tree write-locked.
+static void index_add(struct inode *i) {
+	char term[INDEX_TERM_MAX + 1];
+	const char *p = i->file.contents, *end = p + i->file.size;
+	if (p != NULL)
+		while ((p = index_next_term(p, end, term)) != NULL)
+			index_term_add(term, i->ino);
+	i->file.indexed = 1;
+}
 
-	struct list_node *n;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			free(name);
+//Drop i from the index before its contents change or it goes away.
+static void index_remove(struct inode *i) {
+	char term[INDEX_TERM_MAX + 1];
+	const char *p = i->file.contents, *end = p + i->file.size;
+	if (!i->file.indexed)
+		return;
+	if (p != NULL)
+		while ((p = index_next_term(p, end, term)) != NULL)
+			index_term_del(term, i->ino);
+	i->file.indexed = 0;
+}
+
+//Look the terms of query up, rarest first. Returns their number, or 0 when
+//the query has no terms or some term is in no file at all.
+static int index_query(const char *query, struct index_term **terms) {
+	char term[INDEX_TERM_MAX + 1];
+	const char *p = query, *end = query + strlen(query);
+	int n = 0, k;
+	while (n < INDEX_QUERY_TERMS && (p = index_next_term(p, end, term)) != NULL) {
+		struct avl_node *node = avl_find(&search_index, term, index_term_cmp);
+		if (node == NULL)
 			return 0;
+		struct index_term *t = index_term_of(node);
+		for (k = n; k > 0 && terms[k - 1]->n > t->n; k--)
+			terms[k] = terms[k - 1];
+		terms[k] = t;
+		n++;
+	}
+	return n;
+}
+
+static int index_match(struct index_term **terms, int n, ino_t ino) {
+	int k;
+	for (k = 1; k < n; k++)
+		if (!index_has(terms[k], ino))
+			return 0;
+	return 1;
+}
+
+//Write the path of name e, without the leading '/', into buf. Returns its
+//length, or -1 when e is unreachable from the root or the path doesn't fit.
+static int dentry_path(struct dentry *e, char *buf, size_t size) {
+	size_t pos = size;
+	buf[--pos] = '\0';
+	while (e != NULL) {
+		size_t len = strlen(e->name);
+		if (len + (pos < size - 1) > pos)
+			return -1;
+		if (pos < size - 1)
+			buf[--pos] = '/';
+		pos -= len;
+		memcpy(buf + pos, e->name, len);
+		if (e->parent == rootDir) {
+			memmove(buf, buf + pos, size - pos);
+			return size - 1 - pos;
 		}
+		//directories have a single name
+		e = e->parent->dentry;
 	}
-	free(name);
-	return -ENOENT;
+	return -1;
+}
 
-	return 0;
+//The same for inode i, by its newest name that is still reachable.
+static int inode_path(struct inode *i, char *buf, size_t size) {
+	struct dentry *e;
+	if (i == rootDir) {
+		buf[0] = '\0';
+		return 0;
+	}
+	for (e = i->dentry; e != NULL; e = e->alias) {
+		int len = dentry_path(e, buf, size);
+		if (len >= 0)
+			return len;
+	}
+	return -1;
 }
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
-{
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -ENOENT;
+//**********************************************************************************
+//Runtime statistics
+//
+//Every thread that touches the filesystem owns one xmp_stats block and is the
+//only writer of it, so the hot path never takes a lock. Readers (/.stats and
+//the optional prometheus socket) walk all blocks and merge them.
+//**********************************************************************************
+#define STATS_PATH "/.stats"
+
+enum xmp_stat_op {
+	OP_GETATTR,
+	OP_READDIR,
+	OP_READ,
+	OP_WRITE,
+	OP_MKDIR,
+	OP_CREATE,
+	OP_FETCH,
+	OP_PARSE,
+	OP_COUNT
+};
+
+static const char *xmp_stat_names[OP_COUNT] = {
+	"getattr", "readdir", "read", "write", "mkdir", "create", "fetch", "parse",
+};
+
+struct xmp_stats {
+	struct hist lat[OP_COUNT];
+	uint64_t errors[OP_COUNT];
+	uint64_t bytes_fetched;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	int alive;
+	struct list_node node;
+};
 
+struct xmp_options {
+	const char *stats_socket;
+	const char *search_base;
+	unsigned int refresh_ttl;	/* seconds before a result is re-fetched, 0 = never */
+	unsigned int refresh_rate;	/* background re-fetches per second */
+	unsigned int fetch_inflight;	/* requests in flight per upstream host */
+	unsigned int fetch_rate;	/* requests per second per upstream host */
+	unsigned int fetch_queue;	/* fetches allowed to wait per host */
+	unsigned int fetch_timeout;	/* seconds for a whole fetch, retries included */
+	unsigned int fetch_retries;
+	int lazy_mkdir;		/* mkdir leaves "00" to be fetched on first open */
+	int pinned_workers;		/* run pinned_loop instead of fuse_main */
+	unsigned int workers;		/* pinned_loop threads, 0 = one per CPU */
+	unsigned int pool_threads;	/* executor threads, 0 = one per CPU */
+	unsigned int capacity_mb;	/* space for the tree, 0 = physical memory */
+	const char *record;		/* archive fetched pages are appended to */
+	const char *replay;		/* archive fetches are answered from */
+	unsigned int replay_latency;	/* percent of the recorded latency to simulate */
+};
+static struct xmp_options options;
+
+static struct list_node stats_blocks = { &stats_blocks, &stats_blocks };
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static __thread struct xmp_stats *tls_stats;
+
+static void stats_thread_exit(void *arg) {
+	struct xmp_stats *st = arg;
+	pthread_mutex_lock(&stats_lock);
+	st->alive = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//Blocks of exited threads are handed to new threads instead of being freed,
+//so their history stays in the totals and thread churn doesn't grow the list.
+static struct xmp_stats *stats_get(void) {
+	if (tls_stats != NULL)
+		return tls_stats;
+	struct xmp_stats *st = NULL;
 	struct list_node *n;
-	struct f_inode *target_inode;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			target_inode = o;
+	pthread_mutex_lock(&stats_lock);
+	list_for_each (n, &stats_blocks) {
+		struct xmp_stats *o = list_entry(n, struct xmp_stats, node);
+		if (!o->alive) {
+			st = o;
 			break;
 		}
 	}
-	free(name);
-	if(target_inode != NULL) {
-		if(target_inode->p_node != NULL)
-			target_inode = list_entry(target_inode->p_node, struct f_inode, node);
-		if (offset < target_inode->size) {
-			if (offset + size > target_inode->size)
-				size = target_inode->size - offset;
-			memcpy(buf, target_inode->contents + offset, size);
-		} else
-			size = 0;
-		return size;
+	if (st == NULL) {
+		st = (struct xmp_stats *)calloc(1, sizeof(struct xmp_stats));
+		if (st == NULL) {
+			pthread_mutex_unlock(&stats_lock);
+			return NULL;
+		}
+		list_add_prev(&st->node, &stats_blocks);
 	}
-	return -ENOENT;
+	st->alive = 1;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, st);
+	tls_stats = st;
+	return st;
 }
 
-static int xmp_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+static void stats_record(enum xmp_stat_op op, uint64_t start, int ret) {
+	struct xmp_stats *st = stats_get();
+	if (st == NULL)
+		return;
+	hist_record(&st->lat[op], stats_now_ns() - start);
+	if (ret < 0)
+		__hist_bump(&st->errors[op], 1);
+}
+
+#define stats_add(field, v) do { \
+	struct xmp_stats *__st = stats_get(); \
+	if (__st != NULL) \
+		__hist_bump(&__st->field, (v)); \
+} while (0)
+
+static void stats_collect(struct xmp_stats *sum) {
+	struct list_node *n;
+	int i;
+	memset(sum, 0, sizeof(struct xmp_stats));
+	pthread_mutex_lock(&stats_lock);
+	list_for_each (n, &stats_blocks) {
+		struct xmp_stats *o = list_entry(n, struct xmp_stats, node);
+		for (i = 0; i < OP_COUNT; i++) {
+			hist_merge(&sum->lat[i], &o->lat[i]);
+			sum->errors[i] += __atomic_load_n(&o->errors[i], __ATOMIC_RELAXED);
+		}
+		sum->bytes_fetched += __atomic_load_n(&o->bytes_fetched, __ATOMIC_RELAXED);
+		sum->bytes_read    += __atomic_load_n(&o->bytes_read, __ATOMIC_RELAXED);
+		sum->bytes_written += __atomic_load_n(&o->bytes_written, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//Render a snapshot into a malloced buffer, either as a plain table or in the
+//prometheus text exposition format. Returns NULL on allocation failure.
+static char *stats_render(size_t *len, int prometheus) {
+	struct xmp_stats *sum = (struct xmp_stats *)malloc(sizeof(struct xmp_stats));
+	if (sum == NULL)
+		return NULL;
+	stats_collect(sum);
+
+	char *out = NULL;
+	FILE *f = open_memstream(&out, len);
+	if (f == NULL) {
+		free(sum);
+		return NULL;
+	}
+	int i;
+	if (!prometheus) {
+		fprintf(f, "%-8s %12s %8s %10s %10s %10s %10s\n",
+			"op", "count", "errors", "p50_us", "p99_us", "p999_us", "max_us");
+		for (i = 0; i < OP_COUNT; i++) {
+			struct hist *h = &sum->lat[i];
+			fprintf(f, "%-8s %12llu %8llu %10.1f %10.1f %10.1f %10.1f\n",
+				xmp_stat_names[i],
+				(unsigned long long)h->count,
+				(unsigned long long)sum->errors[i],
+				hist_quantile(h, 0.5) / 1e3,
+				hist_quantile(h, 0.99) / 1e3,
+				hist_quantile(h, 0.999) / 1e3,
+				h->max / 1e3);
+		}
+		fprintf(f, "bytes_fetched %llu\n", (unsigned long long)sum->bytes_fetched);
+		fprintf(f, "bytes_read %llu\n", (unsigned long long)sum->bytes_read);
+		fprintf(f, "bytes_written %llu\n", (unsigned long long)sum->bytes_written);
+		fprintf(f, "inodes %llu\n",
+			(unsigned long long)__atomic_load_n(&space_inodes, __ATOMIC_RELAXED));
+		for (i = 0; i < SPACE_KINDS; i++)
+			fprintf(f, "space_%s %llu\n", space_names[i],
+				(unsigned long long)__atomic_load_n(&space_bytes[i], __ATOMIC_RELAXED));
+		fprintf(f, "space_capacity %llu\n", (unsigned long long)space_capacity);
+	} else {
+		static const double quantiles[] = { 0.5, 0.99, 0.999 };
+		size_t q;
+		fprintf(f, "# TYPE dirspider_op_duration_seconds summary\n");
+		for (i = 0; i < OP_COUNT; i++) {
+			struct hist *h = &sum->lat[i];
+			for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+				fprintf(f, "dirspider_op_duration_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+					xmp_stat_names[i], quantiles[q], hist_quantile(h, quantiles[q]) / 1e9);
+			fprintf(f, "dirspider_op_duration_seconds_sum{op=\"%s\"} %.9f\n",
+				xmp_stat_names[i], h->sum / 1e9);
+			fprintf(f, "dirspider_op_duration_seconds_count{op=\"%s\"} %llu\n",
+				xmp_stat_names[i], (unsigned long long)h->count);
+		}
+		fprintf(f, "# TYPE dirspider_op_errors_total counter\n");
+		for (i = 0; i < OP_COUNT; i++)
+			fprintf(f, "dirspider_op_errors_total{op=\"%s\"} %llu\n",
+				xmp_stat_names[i], (unsigned long long)sum->errors[i]);
+		fprintf(f, "# TYPE dirspider_bytes_total counter\n");
+		fprintf(f, "dirspider_bytes_total{kind=\"fetched\"} %llu\n", (unsigned long long)sum->bytes_fetched);
+		fprintf(f, "dirspider_bytes_total{kind=\"read\"} %llu\n", (unsigned long long)sum->bytes_read);
+		fprintf(f, "dirspider_bytes_total{kind=\"written\"} %llu\n", (unsigned long long)sum->bytes_written);
+		fprintf(f, "# TYPE dirspider_inodes gauge\n");
+		fprintf(f, "dirspider_inodes %llu\n",
+			(unsigned long long)__atomic_load_n(&space_inodes, __ATOMIC_RELAXED));
+		fprintf(f, "# TYPE dirspider_space_bytes gauge\n");
+		for (i = 0; i < SPACE_KINDS; i++)
+			fprintf(f, "dirspider_space_bytes{kind=\"%s\"} %llu\n", space_names[i],
+				(unsigned long long)__atomic_load_n(&space_bytes[i], __ATOMIC_RELAXED));
+		fprintf(f, "dirspider_space_bytes{kind=\"capacity\"} %llu\n",
+			(unsigned long long)space_capacity);
+	}
+	fclose(f);
+	free(sum);
+	return out;
+}
+
+//Serve one prometheus snapshot per connection on a local unix socket.
+static void *stats_socket_loop(void *arg) {
+	int fd = (int)(intptr_t)arg;
+	for (;;) {
+		int c = accept(fd, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		size_t len;
+		char *text = stats_render(&len, 1);
+		if (text != NULL) {
+			size_t off = 0;
+			while (off < len) {
+				ssize_t w = write(c, text + off, len - off);
+				if (w <= 0)
+					break;
+				off += w;
+			}
+			free(text);
+		}
+		close(c);
+	}
+	close(fd);
+	return NULL;
+}
+
+static int stats_socket_start(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+	pthread_t tid;
+	int err = pthread_create(&tid, NULL, stats_socket_loop, (void *)(intptr_t)fd);
+	if (err) {
+		close(fd);
+		return -err;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+struct stats_file {
+	char *data;
+	size_t size;
+};
+
+//An open /.stats carries its snapshot in fi->fh tagged with FH_STATS, any
+//other open file its ino. Only the handle tells them apart: a file unlinked
+//while open has no path.
+#define FH_STATS ((uint64_t)1 << 63)
+
+static uint64_t stats_fh(struct stats_file *sf) {
+	return (uint64_t)(uintptr_t)sf | FH_STATS;
+}
+
+static struct stats_file *fh_stats(uint64_t fh) {
+	return fh & FH_STATS ? (struct stats_file *)(uintptr_t)(fh & ~FH_STATS) : NULL;
+}
+
+static struct fuse *fuse_instance;
+static int refresh_start(void);
+static int exec_start(void);
+
+static void *xmp_init(struct fuse_conn_info *conn,
+		      struct fuse_config *cfg)
 {
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
+	(void) conn;
+	cfg->use_ino = 1;
+	cfg->kernel_cache = 1;
+	cfg->hard_remove = 1;
+	cfg->direct_io = 1;
+
+	//started here rather than in main: fuse_main may fork into the background
+	if (options.stats_socket != NULL && stats_socket_start(options.stats_socket) != 0)
+		fprintf(stderr, "dirSpider: cannot listen on %s\n", options.stats_socket);
+	fuse_instance = fuse_get_context()->fuse;
+	if (exec_start() != 0)
+		fprintf(stderr, "dirSpider: cannot start the executor, parsing inline\n");
+	if (options.refresh_ttl != 0 && refresh_start() != 0)
+		fprintf(stderr, "dirSpider: cannot start the refresh thread\n");
+	if (reap_start() != 0)
+		fprintf(stderr, "dirSpider: cannot start the reaper, tearing down inline\n");
+
+	return NULL;
+}
+
+static size_t min(size_t a, size_t b) {
+	return a > b ? b : a;
+}
+
+//**********************************************************************************
+//Path walk
+//
+//Every handler that takes a path starts here, so the walk reads the path in
+//place and never allocates: each component is looked up by its length in the
+//path, and the name handed back points into the path itself. The paths libfuse
+//passes are absolute, with single slashes and no trailing one.
+//**********************************************************************************
+
+//Walk the first len bytes of path, starting from top, down to the directory
+//holding their last component, which is returned as *name and *name_len.
+static int walk_parent(struct inode *top, const char *path, size_t len, struct inode **p_node,
+		       const char **name, size_t *name_len) {
+	const char *end = path + len, *last = path + 1, *slash;
+	if (len < 2 || *path != '/')
 		return -ENOENT;
+	struct inode *cur_node = top;
+	while ((slash = (const char *)memchr(last, '/', end - last)) != NULL) {
+		struct dentry *e = dir_find_n(cur_node, last, slash - last);
+		if(e == NULL || e->inode->type != INODE_DIR)
+			return -ENOENT;
+		cur_node = e->inode;
+		last = slash + 1;
+	}
+	*p_node = cur_node;
+	*name = last;
+	*name_len = end - last;
+	return 0;
+}
+
+//The parent of path and its last component; *name points into path.
+static int get_parent_inode(const char *path, struct inode **p_node, const char **name) {
+	size_t name_len;
+	return walk_parent(rootDir, path, strlen(path), p_node, name, &name_len);
+}
 
+//The inode at the first len bytes of path, taken relative to top.
+static struct inode *lookup_at(struct inode *top, const char *path, size_t len) {
+	if (len <= 1 && *path == '/')
+		return top;
+
+	const char *name;
+	size_t name_len;
+	struct inode *ptdir_inode;
+	if (walk_parent(top, path, len, &ptdir_inode, &name, &name_len))
+		return NULL;
+
+	struct dentry *e = dir_find_n(ptdir_inode, name, name_len);
+	return e != NULL ? e->inode : NULL;
+}
+
+static struct inode *lookup_inode(const char *path) {
+	return lookup_at(rootDir, path, strlen(path));
+}
+
+//**********************************************************************************
+//Range views
+//
+//"<dir>/.from/<name>" is a read-only view of <dir> listing only the children
+//that sort at or after <name>, e.g. "ls q/.from/30" for all pages from 30 on.
+//It is answered straight from the name index without touching the rest.
+//The children it lists resolve inside it, "q/.from/30/31" being "q/31", for
+//the handlers that only read; the others don't see into views at all.
+//**********************************************************************************
+#define RANGE_DIR "/.from"
+
+struct range_path {
+	size_t dir_len;		/* <dir> is the first dir_len bytes of the path */
+	const char *from;	/* the start key, from_len bytes long */
+	size_t from_len;
+	const char *rest;	/* "" for the view itself, else "/<child>..." */
+};
+
+//Split a path at or below a range view, "<dir>/.from/<key>[/<child>...]".
+//Only a whole ".from" component starts a view. Returns 0 when path is not in
+//one; everything in rp points into path, and rp may be NULL.
+static int range_split(const char *path, struct range_path *rp) {
+	size_t len = strlen(RANGE_DIR);
+	const char *p = path;
+	while ((p = strstr(p, RANGE_DIR)) != NULL && p[len] != '/' && p[len] != '\0')
+		p += len;
+	if (p == NULL)
+		return 0;
+	if (rp != NULL) {
+		rp->dir_len = p == path ? 1 : (size_t)(p - path);
+		rp->from = p + len + (p[len] == '/');
+		rp->from_len = strcspn(rp->from, "/");
+		rp->rest = rp->from + rp->from_len;
+	}
+	return 1;
+}
+
+//The inode a range view path stands for: <dir> for the view itself, and
+//"<dir>/<child>..." below it as long as child is listed, i.e. sorts at or
+//after the key.
+static struct inode *range_lookup(const char *path, const struct range_path *rp) {
+	struct inode *dir = lookup_at(rootDir, path, rp->dir_len);
+	if (dir == NULL || dir->type != INODE_DIR)
+		return NULL;
+	if (*rp->rest == '\0')
+		return dir;
+	const char *child = rp->rest + 1;
+	size_t child_len = strcspn(child, "/");
+	int c = memcmp(child, rp->from, min(child_len, rp->from_len));
+	if (c < 0 || (c == 0 && child_len < rp->from_len))
+		return NULL;
+	return lookup_at(dir, rp->rest, strlen(rp->rest));
+}
+
+//lookup_inode that also sees into range views, for the handlers that only read.
+static struct inode *lookup_view(const char *path) {
+	struct range_path rp;
+	return range_split(path, &rp) ? range_lookup(path, &rp) : lookup_inode(path);
+}
+
+//The directory at path, resolving range views; *from is the start key of a
+//view and "" for anything else.
+static struct inode *lookup_dir_range(const char *path, const char **from) {
+	struct range_path rp;
+	struct inode *i;
+	*from = "";
+	if (!range_split(path, &rp))
+		i = lookup_inode(path);
+	else {
+		i = range_lookup(path, &rp);
+		//the key runs to the end of path then
+		if (*rp.rest == '\0')
+			*from = rp.from;
+	}
+	return i != NULL && i->type == INODE_DIR ? i : NULL;
+}
+
+static off_t lazy_size(void);
+
+static void fill_stat(struct inode *i, struct stat *st) {
+	st->st_ino = i->ino;
+	st->st_mode = i->mode;
+	st->st_uid = i->uid;
+	st->st_gid = i->gid;
+	st->st_atim = i->atime;
+	st->st_mtim = i->mtime;
+	st->st_ctim = i->ctime;
+	switch (i->type) {
+		case INODE_DIR:
+			st->st_nlink = 2 + i->dir.nchildren;
+			st->st_size = i->dir.name_bytes;
+			break;
+		case INODE_FILE:
+			st->st_nlink = i->nlink;
+			st->st_size = i->file.lazy != LAZY_NONE ? lazy_size() : (off_t)i->file.size;
+			break;
+		case INODE_LINK:
+			st->st_nlink = i->nlink;
+			st->st_size = i->link.len;
+			break;
+	}
+}
+
+static void fill_stats_stat(struct stat *st) {
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+}
+
+//**********************************************************************************
+//Search views
+//
+//"/.search/<terms>" lists the result files matching all of <terms> (see the
+//search index) as symlinks named by their ino, e.g. "ls -l /.search/linux".
+//A link points at the file's current name relative to itself, so it follows
+//renames; a file with several names is found under the one it got last.
+//Neither level is kept anywhere: both are answered from the index on demand.
+//**********************************************************************************
+#define SEARCH_DIR "/.search"
+
+enum search_kind {
+	SEARCH_NONE,	/* not below SEARCH_DIR */
+	SEARCH_ROOT,	/* SEARCH_DIR itself */
+	SEARCH_QUERY,	/* SEARCH_DIR/<terms> */
+	SEARCH_ENTRY,	/* SEARCH_DIR/<terms>/<ino> */
+};
+
+//Classify path and copy its terms into query. *entry points into path.
+//Returns -ENOENT for anything deeper than an entry.
+static int search_split(const char *path, char *query, const char **entry) {
+	size_t len = strlen(SEARCH_DIR);
+	if (strncmp(path, SEARCH_DIR, len) != 0 || (path[len] != '/' && path[len] != '\0'))
+		return SEARCH_NONE;
+	const char *q = path + len;
+	if (*q == '/')
+		q++;
+	if (*q == '\0')
+		return SEARCH_ROOT;
+	const char *slash = strchr(q, '/');
+	size_t qlen = slash != NULL ? (size_t)(slash - q) : strlen(q);
+	if (qlen > MAX_NAMELEN)
+		return -ENOENT;
+	memcpy(query, q, qlen);
+	query[qlen] = '\0';
+	if (slash == NULL)
+		return SEARCH_QUERY;
+	*entry = slash + 1;
+	return strchr(*entry, '/') != NULL ? -ENOENT : SEARCH_ENTRY;
+}
+
+//The file behind entry name of a query, if it still matches.
+static struct inode *search_entry(const char *query, const char *name) {
+	struct index_term *terms[INDEX_QUERY_TERMS];
+	int n = index_query(query, terms);
+	if (n == 0 || *name < '1' || *name > '9')
+		return NULL;
+	char *end;
+	unsigned long long ino = strtoull(name, &end, 10);
+	if (*end != '\0' || !index_has(terms[0], ino) || !index_match(terms, n, ino))
+		return NULL;
+	return inode_get(ino);
+}
+
+//Link target of i as seen from SEARCH_DIR/<terms>; -1 when it has no name.
+static int search_target(struct inode *i, char *buf, size_t size) {
+	strcpy(buf, "../../");
+	int len = inode_path(i, buf + 6, size - 6);
+	return len < 0 ? -1 : len + 6;
+}
+
+static void fill_search_stat(struct stat *st, int link_len) {
+	if (link_len < 0) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	} else {
+		st->st_mode = S_IFLNK | 0777;
+		st->st_nlink = 1;
+		st->st_size = link_len;
+	}
+	st->st_uid = rootDir->uid;
+	st->st_gid = rootDir->gid;
+	st->st_atim = st->st_mtim = st->st_ctim = rootDir->mtime;
+}
+
+static int search_getattr(int kind, const char *query, const char *name, struct stat *st) {
+	struct index_term *terms[INDEX_QUERY_TERMS];
+	char target[PATH_MAX];
+	struct inode *i;
+	int len = -1;
+	if (kind == SEARCH_QUERY && index_query(query, terms) == 0)
+		return -ENOENT;
+	if (kind == SEARCH_ENTRY && ((i = search_entry(query, name)) == NULL ||
+			(len = search_target(i, target, sizeof(target))) < 0))
+		return -ENOENT;
+	fill_search_stat(st, len);
+	return 0;
+}
+
+//Matches are listed in ino order, with the ino as their offset.
+static int search_readdir(int kind, const char *query, void *buf, fuse_fill_dir_t filler,
+			  off_t offset, enum fuse_readdir_flags flags) {
+	int plus = (flags & FUSE_READDIR_PLUS) != 0;
+	enum fuse_fill_dir_flags fill_flags = plus ? FUSE_FILL_DIR_PLUS : 0;
+	struct index_term *terms[INDEX_QUERY_TERMS];
+	char target[PATH_MAX], name[32];
+	struct stat st;
+	int n = kind == SEARCH_QUERY ? index_query(query, terms) : 0;
+	if (kind == SEARCH_QUERY && n == 0)
+		return -ENOENT;
+
+	if (offset < COOKIE_DOT) {
+		memset(&st, 0, sizeof(struct stat));
+		fill_search_stat(&st, -1);
+		if (filler(buf, ".", plus ? &st : NULL, COOKIE_DOT, fill_flags))
+			return 0;
+	}
+	if (offset < COOKIE_DOTDOT && filler(buf, "..", NULL, COOKIE_DOTDOT, 0))
+		return 0;
+	if (n == 0)
+		return 0;
+
+	size_t k = offset < COOKIE_FIRST ? 0 : index_bound(terms[0], offset - COOKIE_FIRST + 1);
+	for (; k < terms[0]->n; k++) {
+		ino_t ino = terms[0]->inos[k];
+		struct inode *i = inode_get(ino);
+		int len;
+		if (i == NULL || !index_match(terms, n, ino) ||
+		    (len = search_target(i, target, sizeof(target))) < 0)
+			continue;
+		memset(&st, 0, sizeof(struct stat));
+		fill_search_stat(&st, len);
+		snprintf(name, sizeof(name), "%llu", (unsigned long long)ino);
+		if (filler(buf, name, plus ? &st : NULL, ino + COOKIE_FIRST, fill_flags))
+			break;
+	}
+	return 0;
+}
+
+static int search_readlink(const char *query, const char *name, char *buf, size_t size) {
+	char target[PATH_MAX];
+	struct inode *i = search_entry(query, name);
+	int len;
+	if (i == NULL || (len = search_target(i, target, sizeof(target))) < 0)
+		return -ENOENT;
+	size_t m_size = (size_t)len < size - 1 ? (size_t)len : size - 1;
+	memcpy(buf, target, m_size);
+	buf[m_size] = '\0';
+	return 0;
+}
+
+//Open handles carry the ino, so reads and writes skip the path walk; with
+//a handle the path may be NULL.
+static struct inode *handle_inode(const char *path, struct fuse_file_info *fi) {
+	if (fi != NULL && fi->fh != 0)
+		return fh_stats(fi->fh) != NULL ? NULL : inode_get(fi->fh);
+	return path != NULL ? lookup_inode(path) : NULL;
+}
+
+static int xmp_getattr(const char *path, struct stat *st,
+		       struct fuse_file_info *fi)
+{
+	memset(st, 0, sizeof(struct stat));
+
+	//an open file answers from its handle, all that is left of one
+	//unlinked while open
+	if (fi != NULL && fi->fh != 0) {
+		struct inode *i;
+		if (fh_stats(fi->fh) != NULL)
+			fill_stats_stat(st);
+		else if ((i = inode_get(fi->fh)) != NULL)
+			fill_stat(i, st);
+		else
+			return -ENOENT;
+		return 0;
+	}
+	if (path == NULL)
+		return -ENOENT;
+
+	if (strcmp(path, STATS_PATH) == 0) {
+		fill_stats_stat(st);
+		return 0;
+	}
+
+	char query[MAX_NAMELEN + 1];
+	const char *entry;
+	int kind = search_split(path, query, &entry);
+	if (kind != SEARCH_NONE)
+		return kind < 0 ? kind : search_getattr(kind, query, entry, st);
+
+	struct range_path rp;
+	if (range_split(path, &rp)) {
+		struct inode *i = range_lookup(path, &rp);
+		if (i == NULL)
+			return -ENOENT;
+		fill_stat(i, st);
+		if (*rp.rest == '\0')
+			st->st_mode &= ~0222;
+		return 0;
+	}
+
+	struct inode *i = lookup_inode(path);
+	if (i == NULL)
+		return -ENOENT;
+	fill_stat(i, st);
+	return 0;
+}
+
+//**********************************************************************************
+//Readdir
+//
+//Entries come out in name order with their cookies as offsets. The open
+//directory handle remembers the offset and name of the last entry passed to
+//the kernel; the usual follow-up call asks for exactly that offset and is
+//resumed with one O(log n) search for the next name, no matter what was
+//inserted or removed meanwhile. Any other offset (seekdir) falls back to
+//finding the child carrying that cookie.
+//**********************************************************************************
+struct dir_handle {
+	ino_t ino;
+	off_t offset;
+	char last_name[MAX_NAMELEN + 1];
+};
+
+static int xmp_opendir(const char *path, struct fuse_file_info *fi)
+{
+	char query[MAX_NAMELEN + 1];
+	const char *from;
+	struct stat st;
+	int kind = search_split(path, query, &from);
+	if (kind != SEARCH_NONE) {
+		int err = kind < 0 ? kind : search_getattr(kind, query, from, &st);
+		if (err == 0 && kind == SEARCH_ENTRY)
+			err = -ENOTDIR;
+		if (err)
+			return err;
+	} else if (lookup_dir_range(path, &from) == NULL)
+		return lookup_view(path) != NULL ? -ENOTDIR : -ENOENT;
+	struct dir_handle *dh = (struct dir_handle *)calloc(1, sizeof(struct dir_handle));
+	if (dh == NULL)
+		return -ENOMEM;
+	fi->fh = (uint64_t)(uintptr_t)dh;
+	return 0;
+}
+
+static int xmp_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	free((struct dir_handle *)(uintptr_t)fi->fh);
+	return 0;
+}
+
+static struct dentry *readdir_resume(struct inode *dir, struct dir_handle *dh,
+				     off_t offset, const char *from) {
+	if (offset < COOKIE_FIRST)
+		return dir_seek(dir, from, 0);
+	if (dh != NULL && dh->ino == dir->ino && dh->offset == offset)
+		return dir_seek(dir, dh->last_name, 1);
+	struct dentry *e;
+	for (e = dir_seek(dir, from, 0); e != NULL; e = dir_next(e))
+		if (e->cookie == offset)
+			return dir_next(e);
+	return NULL;
+}
+
+static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi,
+		       enum fuse_readdir_flags flags)
+{
+	char query[MAX_NAMELEN + 1];
+	const char *from;
+	int kind = search_split(path, query, &from);
+	if (kind != SEARCH_NONE)
+		return kind < 0 ? kind : kind == SEARCH_ENTRY ? -ENOTDIR :
+			search_readdir(kind, query, buf, filler, offset, flags);
+
+	struct inode *dir = lookup_dir_range(path, &from);
+	if (dir == NULL)
+		return -ENOENT;
+
+	int plus = (flags & FUSE_READDIR_PLUS) != 0;
+	enum fuse_fill_dir_flags fill_flags = plus ? FUSE_FILL_DIR_PLUS : 0;
+	struct stat st;
+
+	if (offset < COOKIE_DOT) {
+		memset(&st, 0, sizeof(struct stat));
+		fill_stat(dir, &st);
+		if (filler(buf, ".", plus ? &st : NULL, COOKIE_DOT, fill_flags))
+			return 0;
+	}
+	if (offset < COOKIE_DOTDOT && filler(buf, "..", NULL, COOKIE_DOTDOT, 0))
+		return 0;
+	if (dir == rootDir && *from == '\0' && offset < COOKIE_STATS) {
+		memset(&st, 0, sizeof(struct stat));
+		fill_stats_stat(&st);
+		if (filler(buf, STATS_PATH + 1, plus ? &st : NULL, COOKIE_STATS, fill_flags))
+			return 0;
+	}
+	if (dir == rootDir && *from == '\0' && offset < COOKIE_SEARCH) {
+		memset(&st, 0, sizeof(struct stat));
+		fill_search_stat(&st, -1);
+		if (filler(buf, SEARCH_DIR + 1, plus ? &st : NULL, COOKIE_SEARCH, fill_flags))
+			return 0;
+	}
+
+	struct dir_handle *dh = fi != NULL ? (struct dir_handle *)(uintptr_t)fi->fh : NULL;
+	struct dentry *e, *last = NULL;
+	for (e = readdir_resume(dir, dh, offset, from); e != NULL; e = dir_next(e)) {
+		memset(&st, 0, sizeof(struct stat));
+		if (plus)
+			fill_stat(e->inode, &st);
+		if (filler(buf, e->name, plus ? &st : NULL, e->cookie, fill_flags))
+			break;
+		last = e;
+	}
+
+	if (dh != NULL && last != NULL) {
+		dh->ino = dir->ino;
+		dh->offset = last->cookie;
+		strcpy(dh->last_name, last->name);
+	}
+	return 0;
+}
+
+#define SPIDER_LENGTH 100
+
+//What process() found on one result page.
+struct spider_page {
+	char *title[SPIDER_LENGTH];
+	char *url[SPIDER_LENGTH];
+	int title_size;
+	int url_size;
+};
+
+static char *join_with_base(char *wd, const char *pn) {
+	const char *url_base = options.search_base;
+	char *result = malloc((
+			strlen(url_base) +
+			strlen("?wd=") +
+			strlen(wd) +
+			strlen("&pn=") +
+			strlen(pn) + 1)*sizeof(char));
+	strcpy(result, url_base);
+	strcat(result, "?wd=");
+	strcat(result, wd);
+	strcat(result, "&pn=");
+	strcat(result, pn);
+	return result;
+}
+
+//user_data is the struct spider_page to fill.
+static void process(cspider_t *cspider, char *d, char *url, void *user_data) {
+	struct spider_page *pg = user_data;
+	uint64_t start = stats_now_ns();
+	stats_add(bytes_fetched, strlen(d));
+	pg->url_size   = xpath(d, "//div[@id='content_left']//h3/a/@href", pg->url, SPIDER_LENGTH);
+	pg->title_size = xpath(d, "//div[@id='content_left']//h3/a", pg->title, SPIDER_LENGTH);
+	stats_record(OP_PARSE, start, 0);
+}
+
+static void spider_page_free(struct spider_page *pg) {
+	int i;
+	for(i=0; i<pg->url_size; i++) {
+		free(pg->url[i]);
+	}
+	for(i=0; i<pg->title_size; i++) {
+		free(pg->title[i]);
+	}
+}
+
+//Join the components of path with '+' into a search query, leaving out the
+//last one if skip_last is set. Returns NULL when nothing is left.
+static char *path_query(const char *path, int skip_last) {
+	char *wd  = (char *)malloc((strlen(path)+1)*sizeof(char));
+	char *buf = (char *)malloc((strlen(path)+1)*sizeof(char));
+	strcpy(buf, path);
+	wd[0] = '\0';
+	char delim[2] = "/";
+	char *last, *next;
+	last = strtok(buf, delim);
+	while(last != NULL) {
+		next = strtok(NULL, delim);
+		if(next == NULL && skip_last)
+			break;
+		if(wd[0] != '\0')
+			strcat(wd, "+");
+		strcat(wd, last);
+		last = next;
+	}
+	free(buf);
+	if(wd[0] == '\0') {
+		free(wd);
+		return NULL;
+	}
+	return wd;
+}
+
+//**********************************************************************************
+//Fetch scheduler
+//
+//Every page goes through one scheduler that keeps the daemon polite however
+//many handlers fetch at once. Per upstream host it bounds the requests in
+//flight (--fetch-inflight) and their rate with a token bucket
+//(--fetch-rate, per second). Interactive fetches (mkdir, create, touch) are
+//admitted before background refreshes. At most --fetch-queue fetches may
+//wait for a host; beyond that they fail at once with EAGAIN, which is the
+//backpressure the FUSE handlers pass on. A fetch that gets throttled or hits
+//a server or network error is retried up to --fetch-retries times with
+//jittered exponential backoff, and the whole fetch, queueing included, has
+//to finish within --fetch-timeout seconds, so a slow upstream can't hold on
+//to the FUSE worker threads.
+//
+//CSpider can set neither a deadline nor request headers and runs its own
+//thread pool per page, so pages are fetched with libcurl (which CSpider is
+//built on) and CSpider only parses them.
+//**********************************************************************************
+#define FETCH_BACKOFF_MS 100
+#define FETCH_BACKOFF_MAX_MS 5000
+
+enum fetch_prio {
+	FETCH_INTERACTIVE,
+	FETCH_BACKGROUND,
+	FETCH_NPRIO
+};
+
+struct fetch_host {
+	struct list_node node;
+	unsigned int inflight;
+	unsigned int waiting[FETCH_NPRIO];
+	double tokens;
+	uint64_t refill_ns;
+	pthread_cond_t cond;
+	char name[];
+};
+
+static struct list_node fetch_hosts = { &fetch_hosts, &fetch_hosts };
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//The host[:port] part of url, which is what limits are kept for.
+static void url_host(const char *url, const char **host, size_t *len) {
+	const char *p = strstr(url, "://");
+	p = p ? p + 3 : url;
+	*host = p;
+	*len = strcspn(p, "/?#");
+}
+
+static struct fetch_host *fetch_host_get(const char *url) {
+	const char *name;
+	size_t len;
+	url_host(url, &name, &len);
+	struct fetch_host *h;
 	struct list_node *n;
-	struct f_inode *target_inode;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			target_inode = o;
+	pthread_mutex_lock(&sched_lock);
+	list_for_each (n, &fetch_hosts) {
+		h = list_entry(n, struct fetch_host, node);
+		if (strlen(h->name) == len && memcmp(h->name, name, len) == 0) {
+			pthread_mutex_unlock(&sched_lock);
+			return h;
+		}
+	}
+	h = (struct fetch_host *)calloc(1, sizeof(struct fetch_host) + len + 1);
+	if (h != NULL) {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&h->cond, &attr);
+		pthread_condattr_destroy(&attr);
+		memcpy(h->name, name, len);
+		h->tokens = options.fetch_rate;
+		h->refill_ns = stats_now_ns();
+		list_add_prev(&h->node, &fetch_hosts);
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return h;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts) {
+	ts->tv_sec = ns / 1000000000ull;
+	ts->tv_nsec = ns % 1000000000ull;
+}
+
+//Wait for an in-flight slot and a token of h. Returns -EAGAIN when too many
+//fetches already wait and -ETIMEDOUT at the deadline (CLOCK_MONOTONIC ns).
+static int fetch_acquire(struct fetch_host *h, enum fetch_prio prio, uint64_t deadline) {
+	pthread_mutex_lock(&sched_lock);
+	if (h->waiting[FETCH_INTERACTIVE] + h->waiting[FETCH_BACKGROUND] >= options.fetch_queue) {
+		pthread_mutex_unlock(&sched_lock);
+		return -EAGAIN;
+	}
+	h->waiting[prio]++;
+	int err = 0;
+	for (;;) {
+		uint64_t now = stats_now_ns();
+		h->tokens += (now - h->refill_ns) * (double)options.fetch_rate / 1e9;
+		if (h->tokens > options.fetch_rate)
+			h->tokens = options.fetch_rate;
+		h->refill_ns = now;
+
+		int behind = prio == FETCH_BACKGROUND && h->waiting[FETCH_INTERACTIVE] > 0;
+		if (!behind && h->inflight < options.fetch_inflight && h->tokens >= 1) {
+			h->tokens -= 1;
+			h->inflight++;
+			break;
+		}
+		if (now >= deadline) {
+			err = -ETIMEDOUT;
+			break;
+		}
+		//sleep until the next token is due unless a slot frees up first
+		uint64_t wake = deadline;
+		if (h->tokens < 1) {
+			uint64_t due = now + (uint64_t)((1 - h->tokens) * 1e9 / options.fetch_rate) + 1;
+			if (due < wake)
+				wake = due;
+		}
+		struct timespec ts;
+		ns_to_timespec(wake, &ts);
+		pthread_cond_timedwait(&h->cond, &sched_lock, &ts);
+	}
+	h->waiting[prio]--;
+	//a leaving interactive waiter may unblock background ones
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&sched_lock);
+	return err;
+}
+
+//Whether fetches from url's host are turned away right now; lets mkdir
+//refuse before it creates anything.
+static int fetch_busy(const char *url) {
+	struct fetch_host *h = fetch_host_get(url);
+	if (h == NULL)
+		return 0;
+	pthread_mutex_lock(&sched_lock);
+	int busy = h->waiting[FETCH_INTERACTIVE] + h->waiting[FETCH_BACKGROUND] >= options.fetch_queue;
+	pthread_mutex_unlock(&sched_lock);
+	return busy;
+}
+
+static void fetch_release(struct fetch_host *h) {
+	pthread_mutex_lock(&sched_lock);
+	h->inflight--;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+struct http_reply {
+	long status;
+	char *body;
+	size_t body_len;
+	char etag[256];
+	char last_modified[64];
+};
+
+//Copy the value of header "name:" out of line if that is what it holds.
+static void http_header_value(const char *line, size_t len, const char *name,
+			      char *out, size_t out_size) {
+	size_t n = strlen(name);
+	if (len <= n || strncasecmp(line, name, n) != 0 || line[n] != ':')
+		return;
+	line += n + 1;
+	len -= n + 1;
+	while (len > 0 && (*line == ' ' || *line == '\t')) {
+		line++;
+		len--;
+	}
+	while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == '\n'))
+		len--;
+	if (len >= out_size)
+		return;
+	memcpy(out, line, len);
+	out[len] = '\0';
+}
+
+static size_t http_header_cb(char *buf, size_t size, size_t nitems, void *arg) {
+	struct http_reply *r = arg;
+	size_t len = size * nitems;
+	//a redirect starts a new header block
+	if (len > 5 && strncmp(buf, "HTTP/", 5) == 0)
+		r->etag[0] = r->last_modified[0] = '\0';
+	http_header_value(buf, len, "ETag", r->etag, sizeof(r->etag));
+	http_header_value(buf, len, "Last-Modified", r->last_modified, sizeof(r->last_modified));
+	return len;
+}
+
+static size_t http_body_cb(char *buf, size_t size, size_t nitems, void *arg) {
+	return fwrite(buf, size, nitems, (FILE *)arg);
+}
+
+//One GET of url, conditional on the validators that are not NULL and given
+//up after timeout_ms. On success the caller frees r->body, which is NUL
+//terminated and empty for a 304.
+static int http_get(const char *url, const char *etag, const char *last_modified,
+		    long timeout_ms, struct http_reply *r) {
+	memset(r, 0, sizeof(struct http_reply));
+	FILE *body = open_memstream(&r->body, &r->body_len);
+	if (body == NULL)
+		return -ENOMEM;
+	CURL *curl = curl_easy_init();
+	if (curl == NULL) {
+		fclose(body);
+		free(r->body);
+		return -ENOMEM;
+	}
+	struct curl_slist *headers = NULL;
+	char line[320];
+	if (etag != NULL) {
+		snprintf(line, sizeof(line), "If-None-Match: %s", etag);
+		headers = curl_slist_append(headers, line);
+	}
+	if (last_modified != NULL) {
+		snprintf(line, sizeof(line), "If-Modified-Since: %s", last_modified);
+		headers = curl_slist_append(headers, line);
+	}
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0 (Macintosh; Intel Mac OS X 10.10; rv:42.0) Gecko/20100101 Firefox/42.0");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, http_header_cb);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, r);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_body_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, body);
+	CURLcode res = curl_easy_perform(curl);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r->status);
+	curl_slist_free_all(headers);
+	curl_easy_cleanup(curl);
+	fclose(body);
+	if (res != CURLE_OK) {
+		free(r->body);
+		r->body = NULL;
+		return res == CURLE_OPERATION_TIMEDOUT ? -ETIMEDOUT : -EIO;
+	}
+	return 0;
+}
+
+//**********************************************************************************
+//Record and replay
+//
+//--record=FILE appends every page fetched from upstream, with its status,
+//validators and latency, to an archive. --replay=FILE answers fetches from
+//such an archive instead of the network, so the spider, parser and contents
+//path can be measured and compared run after run without network access.
+//Pages are looked up by path and query only, so an archive recorded against
+//one --search-base replays under any other; the latest record of a page
+//wins. Validators are honoured like a server would, with a 304. Replayed
+//pages come back at once, or after --replay-latency=PCT percent of the
+//latency they were recorded with.
+//
+//A record is a header line
+//	DSPIDER1 <url_len> <status> <latency_us> <etag_len> <lm_len> <body_len>
+//followed by that many bytes of url, etag, last modified and body, and "\n".
+//**********************************************************************************
+#define RECORD_MAGIC "DSPIDER1"
+
+struct replay_page {
+	struct avl_node avl;
+	long status;
+	uint64_t latency_us;
+	char etag[256];
+	char last_modified[64];
+	char *body;
+	size_t body_len;
+	char key[];
+};
+
+static struct avl_root replay_pages;
+static FILE *record_file;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define replay_page_of(n) avl_entry(n, struct replay_page, avl)
+
+static int replay_page_cmp(const struct avl_node *n, const void *key) {
+	return strcmp(replay_page_of(n)->key, (const char *)key);
+}
+
+//Path and query of url, "/" if it has none.
+static const char *url_target(const char *url) {
+	const char *p = strstr(url, "://");
+	p = p != NULL ? p + 3 : url;
+	p = strchr(p, '/');
+	return p != NULL ? p : "/";
+}
+
+//Opened in main: a relative path must be taken before fuse_main daemonizes
+//and changes to "/"; the stream survives the fork.
+static int record_open(const char *path) {
+	record_file = fopen(path, "a");
+	return record_file != NULL ? 0 : -errno;
+}
+
+static void record_page(const char *url, struct http_reply *r, uint64_t latency_us) {
+	if (record_file == NULL || r->status == 304)
+		return;
+	pthread_mutex_lock(&record_lock);
+	fprintf(record_file, RECORD_MAGIC " %zu %ld %llu %zu %zu %zu\n", strlen(url), r->status,
+		(unsigned long long)latency_us, strlen(r->etag), strlen(r->last_modified),
+		r->body_len);
+	fputs(url, record_file);
+	fputs(r->etag, record_file);
+	fputs(r->last_modified, record_file);
+	fwrite(r->body, 1, r->body_len, record_file);
+	fputc('\n', record_file);
+	fflush(record_file);
+	pthread_mutex_unlock(&record_lock);
+}
+
+//Read the archive at path. Returns the number of pages, or -errno. A
+//record cut short, as by a crash while recording, ends the archive.
+static int replay_load(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+	size_t url_len, etag_len, lm_len, body_len;
+	unsigned long long latency_us;
+	long status;
+	int n = 0;
+	while (fscanf(f, RECORD_MAGIC " %zu %ld %llu %zu %zu %zu", &url_len, &status,
+		      &latency_us, &etag_len, &lm_len, &body_len) == 6 && fgetc(f) == '\n') {
+		if (etag_len >= sizeof(((struct replay_page *)0)->etag) ||
+		    lm_len >= sizeof(((struct replay_page *)0)->last_modified))
+			break;
+		char *url = (char *)malloc(url_len + 1);
+		struct replay_page *pg = NULL;
+		if (url == NULL || fread(url, 1, url_len, f) != url_len) {
+			free(url);
+			break;
+		}
+		url[url_len] = '\0';
+		const char *key = url_target(url);
+		pg = (struct replay_page *)calloc(1, sizeof(struct replay_page) + strlen(key) + 1);
+		if (pg != NULL) {
+			strcpy(pg->key, key);
+			pg->body = (char *)malloc(body_len + 1);
+		}
+		free(url);
+		if (pg == NULL || pg->body == NULL ||
+		    fread(pg->etag, 1, etag_len, f) != etag_len ||
+		    fread(pg->last_modified, 1, lm_len, f) != lm_len ||
+		    fread(pg->body, 1, body_len, f) != body_len || fgetc(f) != '\n') {
+			if (pg != NULL)
+				free(pg->body);
+			free(pg);
+			break;
+		}
+		pg->body[body_len] = '\0';
+		pg->body_len = body_len;
+		pg->status = status;
+		pg->latency_us = latency_us;
+		struct avl_node *old = avl_insert(&replay_pages, &pg->avl, pg->key, replay_page_cmp);
+		if (old != NULL) {
+			avl_erase(&replay_pages, old);
+			free(replay_page_of(old)->body);
+			free(replay_page_of(old));
+			avl_insert(&replay_pages, &pg->avl, pg->key, replay_page_cmp);
+		} else
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+//Stand-in for http_get when replaying.
+static int replay_get(const char *url, const char *etag, const char *last_modified,
+		      long timeout_ms, struct http_reply *r) {
+	memset(r, 0, sizeof(struct http_reply));
+	struct avl_node *n = avl_find(&replay_pages, url_target(url), replay_page_cmp);
+	if (n == NULL)
+		return -ENODATA;
+	struct replay_page *pg = replay_page_of(n);
+
+	uint64_t delay_us = pg->latency_us * options.replay_latency / 100;
+	if (delay_us != 0) {
+		struct timespec ts;
+		int late = delay_us > (uint64_t)timeout_ms * 1000;
+		ns_to_timespec((late ? (uint64_t)timeout_ms * 1000 : delay_us) * 1000, &ts);
+		nanosleep(&ts, NULL);
+		if (late)
+			return -ETIMEDOUT;
+	}
+
+	r->status = pg->status;
+	strcpy(r->etag, pg->etag);
+	strcpy(r->last_modified, pg->last_modified);
+	if (pg->status == 200 && ((etag != NULL && strcmp(etag, pg->etag) == 0) ||
+			(last_modified != NULL && strcmp(last_modified, pg->last_modified) == 0)))
+		r->status = 304;
+	size_t len = r->status == 304 ? 0 : pg->body_len;
+	r->body = (char *)malloc(len + 1);
+	if (r->body == NULL)
+		return -ENOMEM;
+	memcpy(r->body, pg->body, len);
+	r->body[len] = '\0';
+	r->body_len = len;
+	return 0;
+}
+
+static __thread unsigned int fetch_seed;
+
+//Fetch url through the scheduler. Succeeds with a 200 or a 304 in r; the
+//caller frees r->body.
+static int fetch_page(const char *url, enum fetch_prio prio, const char *etag,
+		      const char *last_modified, struct http_reply *r) {
+	uint64_t start = stats_now_ns();
+	uint64_t deadline = start + options.fetch_timeout * 1000000000ull;
+	struct fetch_host *h = fetch_host_get(url);
+	if (h == NULL)
+		return -ENOMEM;
+	if (fetch_seed == 0)
+		fetch_seed = (unsigned int)start ^ (unsigned int)(uintptr_t)&fetch_seed;
+
+	unsigned int attempt;
+	int err = 0;
+	for (attempt = 0; ; attempt++) {
+		err = fetch_acquire(h, prio, deadline);
+		if (err)
+			break;
+		//a free slot is granted without looking at the clock
+		uint64_t now = stats_now_ns();
+		if (now >= deadline) {
+			fetch_release(h);
+			err = -ETIMEDOUT;
+			break;
+		}
+		long timeout_ms = (long)((deadline - now) / 1000000) + 1;
+		if (options.replay != NULL)
+			err = replay_get(url, etag, last_modified, timeout_ms, r);
+		else {
+			uint64_t sent = stats_now_ns();
+			err = http_get(url, etag, last_modified, timeout_ms, r);
+			if (err == 0)
+				record_page(url, r, (stats_now_ns() - sent) / 1000);
+		}
+		fetch_release(h);
+		if (err == 0 && (r->status == 200 || r->status == 304))
+			break;
+		int transient = err == -EIO || (err == 0 && (r->status == 429 || r->status >= 500));
+		if (err == 0) {
+			free(r->body);
+			r->body = NULL;
+			err = transient ? -EAGAIN : -EIO;
+		}
+		if (!transient || attempt >= options.fetch_retries)
+			break;
+
+		//full jitter: anywhere up to the exponential backoff
+		uint64_t cap = (uint64_t)FETCH_BACKOFF_MS << (attempt < 10 ? attempt : 10);
+		if (cap > FETCH_BACKOFF_MAX_MS)
+			cap = FETCH_BACKOFF_MAX_MS;
+		uint64_t wait = (uint64_t)rand_r(&fetch_seed) % (cap + 1) * 1000000ull;
+		now = stats_now_ns();
+		if (now + wait >= deadline) {
+			err = -ETIMEDOUT;
+			break;
+		}
+		struct timespec ts;
+		ns_to_timespec(wait, &ts);
+		nanosleep(&ts, NULL);
+	}
+	stats_record(OP_FETCH, start, err);
+	return err;
+}
+
+//**********************************************************************************
+//Executor
+//
+//Parsing a page and laying out its contents is CPU work that used to run on
+//whichever FUSE thread fetched it. It now runs on a work-stealing pool with
+//one worker per CPU (--pool-threads=N to change that); the FUSE thread only
+//submits the job and waits for its future, so many pages arriving at once
+//are parsed on all cores.
+//**********************************************************************************
+static struct pool exec_pool;
+static uint64_t parsed_pages, parsed_bytes;	/* pages with results, for lazy_size */
+
+struct parse_job {
+	struct pool_task task;
+	char *page;
+	char *url;
+	char *contents;		/* NULL when the page had no results */
+	size_t size;
+	int results;
+};
+
+static void parse_run(struct pool_task *t) {
+	struct parse_job *j = container_of(t, struct parse_job, task);
+	struct spider_page pg;
+	memset(&pg, 0, sizeof(pg));
+	process(NULL, j->page, j->url, &pg);
+	j->results = pg.title_size;
+	//a title without its url would be laid out from a NULL pointer
+	int n = pg.title_size < pg.url_size ? pg.title_size : pg.url_size;
+	if(n > 0 && pg.title[0] != NULL) {
+		int i;
+		size_t content_size = 0;
+		for(i=0; i<n; i++) {
+			content_size += strlen(pg.title[i]) + strlen("\n");
+			content_size += strlen(pg.url[i]) + strlen("\n");
+		}
+
+		j->contents = content_alloc(content_size + 1);
+		if (j->contents != NULL) {
+			char *p = j->contents;
+			for(i=0; i<n; i++)
+				p += sprintf(p, "%s\n%s\n", pg.title[i], pg.url[i]);
+			j->size = p - j->contents;
+		}
+	}
+	spider_page_free(&pg);
+}
+
+//Parse a fetched page on the pool and lay its titles and urls out as file
+//contents. Returns NULL when the page had no results.
+static char *spider_parse(char *page, char *url, size_t *size, int *results) {
+	struct parse_job j;
+	memset(&j, 0, sizeof(j));
+	j.page = page;
+	j.url = url;
+	if (exec_pool.workers != NULL) {
+		pool_submit(&exec_pool, &j.task, parse_run);
+		pool_wait(&exec_pool, &j.task);
+	} else
+		parse_run(&j.task);
+	*size = j.size;
+	*results = j.results;
+	if (j.contents != NULL) {
+		__atomic_add_fetch(&parsed_pages, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&parsed_bytes, j.size, __ATOMIC_RELAXED);
+	}
+	return j.contents;
+}
+
+static int exec_start(void) {
+	unsigned int n = options.pool_threads;
+	if (n == 0) {
+		cpu_set_t allowed;
+		n = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+	}
+	return -pool_init(&exec_pool, n);
+}
+
+//Record the outcome of a fetch of f_o in user.spider.*.
+static void spider_stamp(struct inode *f_o, struct http_reply *r, int results,
+			 uint64_t fetch_ns, int cache_hit) {
+	char num[32];
+	struct tm tm;
+	time_t now = time(NULL);
+	//a lazy file only counts as fetched once lazy_fill is done with it
+	if (f_o->file.lazy == LAZY_NONE)
+		f_o->file.fetched = now;
+	strftime(num, sizeof(num), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &tm));
+	xattr_set_str(&f_o->xattrs, XATTR_SPIDER "fetched_at", num);
+	if (results >= 0) {
+		snprintf(num, sizeof(num), "%d", results);
+		xattr_set_str(&f_o->xattrs, XATTR_SPIDER "result_count", num);
+	}
+	snprintf(num, sizeof(num), "%llu", (unsigned long long)(fetch_ns / 1000000));
+	xattr_set_str(&f_o->xattrs, XATTR_SPIDER "fetch_ms", num);
+	xattr_set_str(&f_o->xattrs, XATTR_SPIDER "cache_hit", cache_hit ? "1" : "0");
+	if (r->etag[0] != '\0')
+		xattr_set_str(&f_o->xattrs, XATTR_SPIDER "etag", r->etag);
+	if (r->last_modified[0] != '\0')
+		xattr_set_str(&f_o->xattrs, XATTR_SPIDER "last_modified", r->last_modified);
+}
+
+//Record which page f_o holds in user.spider.*; returns its url.
+static char *spider_label(struct inode *f_o, char *wd, const char *pn) {
+	char *url = join_with_base(wd, pn);
+	xattr_set_str(&f_o->xattrs, XATTR_SPIDER "query", wd);
+	xattr_set_str(&f_o->xattrs, XATTR_SPIDER "page", pn);
+	xattr_set_str(&f_o->xattrs, XATTR_SPIDER "url", url);
+	return url;
+}
+
+//Fetch one result page and store the titles and urls found on it as the
+//contents of f_o. Where they came from is recorded in user.spider.*.
+//f_o must not be reachable from the tree yet.
+static int spider_fetch(struct inode *f_o, char *wd, const char *pn, enum fetch_prio prio) {
+	char *url = spider_label(f_o, wd, pn);
+
+	struct http_reply r;
+	uint64_t fetch_start = stats_now_ns();
+	int err = fetch_page(url, prio, NULL, NULL, &r);
+	uint64_t fetch_ns = stats_now_ns() - fetch_start;
+	if (err) {
+		//still a result file, so touch or the refresher can try again
+		f_o->file.fetched = time(NULL);
+		free(url);
+		return err;
+	}
+
+	size_t size;
+	int results;
+	char *contents = spider_parse(r.body, url, &size, &results);
+	free(url);
+	spider_stamp(f_o, &r, results, fetch_ns, 0);
+	free(r.body);
+	if (contents != NULL) {
+		content_put(f_o->file.contents);
+		f_o->file.size = size;
+		f_o->file.contents = contents;
+		inode_touch(f_o, 1);
+	}
+	return 0;
+}
+
+//**********************************************************************************
+//Refresh
+//
+//A result file is re-fetched when it is touched, and, with --refresh-ttl, by a
+//background thread once its last fetch is older than the TTL. Refreshes ask
+//with If-None-Match/If-Modified-Since and the validators of the previous
+//answer, kept in user.spider.etag and user.spider.last_modified. A 304, or a
+//page whose results didn't change, leaves contents and mtime alone; only a
+//real change swaps the contents and invalidates the kernel cache. The
+//background thread refreshes at most --refresh-rate files a second, at
+//background priority. Fetched files wait for it on a queue ordered by fetch
+//time, so it only ever looks at the head of the queue, however large the tree.
+//Once the user changes a result file it is theirs: it leaves the queue, and
+//neither touch nor the refresher fetches over it.
+//**********************************************************************************
+
+//All of it under the tree write lock.
+static struct list_node refresh_queue = { &refresh_queue, &refresh_queue };
+
+#define refresh_entry(n) list_entry(n, struct inode, file.refresh)
+
+static void refresh_dequeue(struct inode *i) {
+	if (i->file.refresh.next != NULL) {
+		__list_del(&i->file.refresh);
+		i->file.refresh.next = NULL;
+	}
+}
+
+//(Re)queue file i by its fetch time, or take it off once that is 0. It was
+//usually just stamped and goes last; the walk back only matters for a fetch
+//that finished before others but was linked in after them.
+static void refresh_requeue(struct inode *i) {
+	refresh_dequeue(i);
+	if (options.refresh_ttl == 0 || i->file.fetched == 0)
+		return;
+	struct list_node *p = refresh_queue.prev;
+	while (p != &refresh_queue && refresh_entry(p)->file.fetched > i->file.fetched)
+		p = p->prev;
+	list_add_prev(&i->file.refresh, p->next);
+}
+
+
+//Copy a string attribute out of the tree; NULL if it is not set.
+static char *xattr_dup_str(struct inode *i, const char *name) {
+	struct xattr_ent *e = xattr_find(i->xattrs, name);
+	if (e == NULL)
+		return NULL;
+	char *s = (char *)malloc(e->value_len + 1);
+	if (s != NULL) {
+		memcpy(s, xattr_ent_value(e), e->value_len);
+		s[e->value_len] = '\0';
+	}
+	return s;
+}
+
+//Re-fetch the page behind result file f_o, which the caller has pinned and
+//which is called with the tree lock not held. Returns 1 if the contents
+//changed, 0 if not, or a negative errno.
+static int spider_refresh(struct inode *f_o, enum fetch_prio prio) {
+	pthread_rwlock_rdlock(&tree_lock);
+	char *url = xattr_dup_str(f_o, XATTR_SPIDER "url");
+	char *etag = xattr_dup_str(f_o, XATTR_SPIDER "etag");
+	char *last_modified = xattr_dup_str(f_o, XATTR_SPIDER "last_modified");
+	pthread_rwlock_unlock(&tree_lock);
+	if (url == NULL) {
+		free(etag);
+		free(last_modified);
+		return -ENODATA;
+	}
+
+	struct http_reply r;
+	uint64_t fetch_start = stats_now_ns();
+	int err = fetch_page(url, prio, etag, last_modified, &r);
+	uint64_t fetch_ns = stats_now_ns() - fetch_start;
+	free(etag);
+	free(last_modified);
+
+	char *contents = NULL;
+	size_t size = 0;
+	int results = -1;
+	if (err == 0 && r.status == 200)
+		contents = spider_parse(r.body, url, &size, &results);
+	free(url);
+
+	int changed = 0;
+	pthread_rwlock_wrlock(&tree_lock);
+	if (f_o->file.fetched == 0 && f_o->file.lazy == LAZY_NONE) {
+		//the user changed it meanwhile, see spider_forget
+		if (err == 0)
+			free(r.body);
+	} else if (err == 0) {
+		if (contents != NULL && (size != f_o->file.size ||
+				memcmp(contents, f_o->file.contents, size) != 0)) {
+			index_remove(f_o);
+			content_put(f_o->file.contents);
+			f_o->file.contents = contents;
+			f_o->file.size = size;
+			contents = NULL;
+			index_add(f_o);
+			inode_touch(f_o, 1);
+			changed = 1;
+		}
+		spider_stamp(f_o, &r, results, fetch_ns, !changed);
+		free(r.body);
+		refresh_requeue(f_o);
+	} else if (f_o->file.lazy == LAZY_NONE) {
+		//wait a full TTL before trying a failing page again
+		f_o->file.fetched = time(NULL);
+		refresh_requeue(f_o);
+	}
+	pthread_rwlock_unlock(&tree_lock);
+	content_put(contents);
+	return err ? err : changed;
+}
+
+static int refresh_stop;	/* set under the write lock once the tree is gone */
+
+struct refresh_job {
+	struct inode *inode;
+	char *path;
+};
+
+//Take up to max_jobs due files off the queue, pinning each one. Returns how
+//many were taken; *next_due is when the next one left is due. Needs the
+//write lock.
+static unsigned int refresh_collect(struct refresh_job *jobs, unsigned int max_jobs,
+				    time_t now, time_t *next_due) {
+	unsigned int njobs = 0;
+	char path[PATH_MAX];
+	*next_due = now + options.refresh_ttl;
+	while (njobs < max_jobs && refresh_queue.next != &refresh_queue) {
+		struct inode *i = refresh_entry(refresh_queue.next);
+		time_t due = i->file.fetched + options.refresh_ttl;
+		if (due > now) {
+			*next_due = due;
 			break;
 		}
+		//refreshing puts it back; an unlinked file that is still open is
+		//left off for good, one whose names are all in a directory being
+		//reaped or too long is tried again a period later
+		refresh_dequeue(i);
+		path[0] = '/';
+		if (inode_path(i, path + 1, sizeof(path) - 1) < 0) {
+			if (i->nlink != 0) {
+				i->file.fetched = now;
+				refresh_requeue(i);
+			}
+			continue;
+		}
+		if ((jobs[njobs].path = strdup(path)) == NULL)
+			continue;
+		inode_pin(i);
+		jobs[njobs].inode = i;
+		njobs++;
+	}
+	return njobs;
+}
+
+static void *refresh_loop(void *arg) {
+	unsigned int max_jobs = options.refresh_rate ? options.refresh_rate : 1;
+	struct refresh_job *jobs = (struct refresh_job *)calloc(max_jobs, sizeof(struct refresh_job));
+	if (jobs == NULL)
+		return NULL;
+	for (;;) {
+		uint64_t start = stats_now_ns();
+		time_t next_due;
+		pthread_rwlock_wrlock(&tree_lock);
+		if (refresh_stop) {
+			pthread_rwlock_unlock(&tree_lock);
+			break;
+		}
+		unsigned int j, njobs = refresh_collect(jobs, max_jobs, time(NULL), &next_due);
+		pthread_rwlock_unlock(&tree_lock);
+
+		for (j = 0; j < njobs; j++) {
+			if (spider_refresh(jobs[j].inode, FETCH_BACKGROUND) > 0 && fuse_instance != NULL)
+				fuse_invalidate_path(fuse_instance, jobs[j].path);
+			free(jobs[j].path);
+		}
+		pthread_rwlock_wrlock(&tree_lock);
+		for (j = 0; j < njobs; j++)
+			inode_unpin(jobs[j].inode);
+		pthread_rwlock_unlock(&tree_lock);
+
+		//a full batch means more is due: go again once the second is over;
+		//otherwise nothing is due before next_due
+		uint64_t spent = stats_now_ns() - start;
+		if (njobs == max_jobs) {
+			if (spent < 1000000000ull) {
+				struct timespec ts = { 0, (long)(1000000000ull - spent) };
+				nanosleep(&ts, NULL);
+			}
+		} else {
+			time_t now = time(NULL);
+			sleep(next_due > now ? next_due - now : 1);
+		}
+	}
+	free(jobs);
+	return NULL;
+}
+
+static int refresh_start(void) {
+	pthread_t tid;
+	int err = pthread_create(&tid, NULL, refresh_loop, NULL);
+	if (err)
+		return -err;
+	pthread_detach(tid);
+	return 0;
+}
+
+//**********************************************************************************
+//Lazy directories
+//
+//With --lazy-mkdir, mkdir only records the query: "00" is linked in empty,
+//labelled with the user.spider.* attributes a fetch would set, and pending.
+//Until its page is fetched a pending file reports the average size of the
+//pages parsed so far. The fetch happens on the first open; openers arriving
+//while it runs wait for it rather than fetch again, and if it fails they all
+//get its error and the file stays pending for the next open.
+//**********************************************************************************
+#define LAZY_SIZE_GUESS 4096
+
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazy_cond = PTHREAD_COND_INITIALIZER;
+
+static off_t lazy_size(void) {
+	uint64_t pages = __atomic_load_n(&parsed_pages, __ATOMIC_RELAXED);
+	uint64_t bytes = __atomic_load_n(&parsed_bytes, __ATOMIC_RELAXED);
+	return pages ? (off_t)(bytes / pages) : LAZY_SIZE_GUESS;
+}
+
+//Changes of lazy state are made under both the tree write lock and lazy_lock,
+//so waiters can watch for them with the tree unlocked.
+static void lazy_set(struct inode *i, enum lazy_state state) {
+	pthread_mutex_lock(&lazy_lock);
+	i->file.lazy = state;
+	pthread_cond_broadcast(&lazy_cond);
+	pthread_mutex_unlock(&lazy_lock);
+}
+
+//Fetch the page of pending file i, or wait for the fetch already under way.
+//Called and returns with the tree write-locked, dropping it meanwhile; the
+//caller keeps i open across the call.
+static int lazy_fill(struct inode *i) {
+	if (i->file.lazy == LAZY_FETCHING) {
+		pthread_mutex_lock(&lazy_lock);
+		pthread_rwlock_unlock(&tree_lock);
+		while (i->file.lazy == LAZY_FETCHING)
+			pthread_cond_wait(&lazy_cond, &lazy_lock);
+		pthread_mutex_unlock(&lazy_lock);
+		pthread_rwlock_wrlock(&tree_lock);
+		return i->file.lazy == LAZY_NONE ? 0 : i->file.lazy_err;
+	}
+	if (i->file.lazy != LAZY_PENDING)
+		return 0;
+
+	lazy_set(i, LAZY_FETCHING);
+	pthread_rwlock_unlock(&tree_lock);
+	int err = spider_refresh(i, FETCH_INTERACTIVE);
+	pthread_rwlock_wrlock(&tree_lock);
+	if (i->file.lazy != LAZY_FETCHING)
+		//written meanwhile, see spider_forget
+		return 0;
+	if (err < 0) {
+		i->file.lazy_err = err;
+		lazy_set(i, LAZY_PENDING);
+		return err;
+	}
+	i->file.fetched = time(NULL);
+	refresh_requeue(i);
+	lazy_set(i, LAZY_NONE);
+	return 0;
+}
+
+//Resolve the parent of path and check that its last component is free.
+//*name points into path.
+static int new_entry(const char *path, struct inode **ptdir_inode, const char **name) {
+	char query[MAX_NAMELEN + 1];
+	const char *from;
+	if (strcmp(path, STATS_PATH) == 0 || range_split(path, NULL) ||
+	    search_split(path, query, &from) != SEARCH_NONE)
+		return -EEXIST;
+	if(get_parent_inode(path, ptdir_inode, name) || *name == NULL || *ptdir_inode == NULL)
+		return -ENOENT;
+	if (strlen(*name) > MAX_NAMELEN)
+		return -ENAMETOOLONG;
+	if (dir_find(*ptdir_inode, *name) != NULL)
+		return -EEXIST;
+	//a new name costs a dentry and, but for rename and link, an inode
+	return space_check(sizeof(struct inode) + sizeof(struct dentry) + strlen(*name));
+}
+
+//The first result page is fetched with the tree unlocked; the new directory
+//stays pinned meanwhile and "00" is only linked in if it is still there.
+//If the fetch fails, "00" is left empty for a later touch to fill in.
+//With --lazy-mkdir "00" is linked in pending right away instead.
+static int xmp_mkdir(const char *path, mode_t mode)
+{
+	const char *name;
+	struct inode *ptdir_inode;
+	if (!options.lazy_mkdir && fetch_busy(options.search_base))
+		return -EAGAIN;
+	pthread_rwlock_wrlock(&tree_lock);
+	int err = new_entry(path, &ptdir_inode, &name);
+	if (err) {
+		pthread_rwlock_unlock(&tree_lock);
+		return err;
+	}
+
+	//both inodes first: once the directory is linked, mkdir has succeeded
+	struct inode *d_o = inode_alloc(INODE_DIR, mode | 0755 | S_IFDIR);
+	struct inode *f_o = d_o != NULL ? inode_alloc(INODE_FILE, S_IFREG | 0644) : NULL;
+	struct dentry *e = f_o != NULL ? dir_link(ptdir_inode, name, d_o) : NULL;
+	if (e == NULL) {
+		if (f_o != NULL)
+			inode_release(f_o);
+		if (d_o != NULL)
+			inode_release(d_o);
+		pthread_rwlock_unlock(&tree_lock);
+		return -ENOMEM;
+	}
+
+	char *wd = path_query(path, 0);
+	if (options.lazy_mkdir) {
+		free(spider_label(f_o, wd, "00"));
+		free(wd);
+		f_o->file.lazy = LAZY_PENDING;
+		if (dir_link(d_o, "00", f_o) == NULL) {
+			inode_release(f_o);
+			inode_put(dir_unlink(ptdir_inode, e));
+			err = -ENOMEM;
+		}
+		pthread_rwlock_unlock(&tree_lock);
+		return err;
 	}
-	free(name);
-	if(target_inode != NULL) {
-		if(target_inode->p_node != NULL)
-			target_inode = list_entry(target_inode->p_node, struct f_inode, node);
-		size_t new_size = offset + size;
-		if (new_size > target_inode->size) {
-			void *new_buf;
-
-			new_buf = realloc(target_inode->contents, new_size);
-			if (!new_buf && new_size)
-				return -ENOMEM;
+	inode_pin(d_o);
+	pthread_rwlock_unlock(&tree_lock);
 
-			if (new_size > target_inode->size)
-				memset(new_buf + target_inode->size, 0, new_size - target_inode->size);
+	spider_fetch(f_o, wd, "00", FETCH_INTERACTIVE);
+	free(wd);
 
-			target_inode->contents = new_buf;
-			target_inode->size = new_size;
-		}
-		memcpy(target_inode->contents + offset, buf, size);
-		return size;
+	pthread_rwlock_wrlock(&tree_lock);
+	if (d_o->nlink == 0 || dir_find(d_o, "00") != NULL || dir_link(d_o, "00", f_o) == NULL)
+		inode_release(f_o);
+	else {
+		index_add(f_o);
+		refresh_requeue(f_o);
 	}
-	return -ENOENT;
+	inode_unpin(d_o);
+	pthread_rwlock_unlock(&tree_lock);
+	return 0;
 }
 
-static int xmp_rename (const char *from, const char *to, unsigned int flags) {
-	if (flags)
-		return -EINVAL;
+static int xmp_unlink(const char *path)
+{
+	const char *name;
+	struct inode *ptdir_inode;
+	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
+		return -ENOENT;
 
-	char *fr_name;
-	struct d_inode *fr_ptdir_inode;
-	if(get_parent_inode(from, &fr_ptdir_inode, &fr_name) || fr_name == NULL || fr_ptdir_inode == NULL)
+	struct dentry *e = dir_find(ptdir_inode, name);
+	if (e == NULL)
 		return -ENOENT;
+	if (e->inode->type == INODE_DIR)
+		return -EISDIR;
+	struct inode *i = dir_unlink(ptdir_inode, e);
+	inode_touch(i, 0);
+	inode_put(i);
+	return 0;
+}
 
-	char *to_name;
-	struct d_inode *to_ptdir_inode;
-	if(get_parent_inode(to, &to_ptdir_inode, &to_name) || to_name == NULL || to_ptdir_inode == NULL) {
-		free(fr_name);
+static int xmp_rmdir(const char *path)
+{
+	const char *name;
+	struct inode *ptdir_inode;
+	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
 		return -ENOENT;
-	}
 
-	if (strlen(to_name) > MAX_NAMELEN) {
-		free(to_name);
-		return -ENAMETOOLONG;
-	}
+	struct dentry *e = dir_find(ptdir_inode, name);
+	if (e == NULL)
+		return -ENOENT;
+	if (e->inode->type != INODE_DIR)
+		return -ENOTDIR;
+	inode_put(dir_unlink(ptdir_inode, e));
+	return 0;
+}
 
-	struct list_node *n;
-	list_for_each (n, &to_ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(to_name, o->name) == 0) {
-			free(fr_name);
-			free(to_name);
-			return -EEXIST;
-		}
+//Like mkdir, the page is fetched unlocked into a file nobody can see yet.
+static int xmp_create(const char *path, mode_t mode,
+		      struct fuse_file_info *fi)
+{
+	const char *name;
+	struct inode *ptdir_inode;
+	pthread_rwlock_wrlock(&tree_lock);
+	int err = new_entry(path, &ptdir_inode, &name);
+	if (err) {
+		pthread_rwlock_unlock(&tree_lock);
+		return err;
 	}
 
-	list_for_each (n, &to_ptdir_inode->dir_entries) {
-		struct d_inode *o = list_entry(n, struct d_inode, node);
-		if (strcmp(to_name, o->name) == 0) {
-			free(fr_name);
-			free(to_name);
-			return -EEXIST;
-		}
+	struct inode *f_o = inode_alloc(INODE_FILE, mode | S_IFREG | 0644);
+	if (f_o == NULL) {
+		pthread_rwlock_unlock(&tree_lock);
+		return -ENOMEM;
 	}
 
-	int filetype = -1;
-	struct list_node *target_node;
-	list_for_each (n, &fr_ptdir_inode->dir_entries) {
-		struct d_inode* o = list_entry(n, struct d_inode, node);
-		if (strcmp(fr_name, o->name) == 0) {
-			filetype = 0;
-			target_node = n;
-			__list_del(n);
-			break;
-		}
+	if(ptdir_inode != rootDir) {
+		inode_pin(ptdir_inode);
+		pthread_rwlock_unlock(&tree_lock);
+		char *wd = path_query(path, 1);
+		err = spider_fetch(f_o, wd, name, FETCH_INTERACTIVE);
+		free(wd);
+		pthread_rwlock_wrlock(&tree_lock);
+		if (err)
+			;
+		else if (ptdir_inode->nlink == 0)
+			err = -ENOENT;
+		else if (dir_find(ptdir_inode, name) != NULL)
+			err = -EEXIST;
+		inode_unpin(ptdir_inode);
 	}
-	list_for_each (n, &fr_ptdir_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		if (strcmp(fr_name, o->name) == 0) {
-			filetype = 1;
-			target_node = n;
-			__list_del(n);
-			break;
-		}
+
+	if (err == 0 && dir_link(ptdir_inode, name, f_o) == NULL)
+		err = -ENOMEM;
+	if (err) {
+		inode_release(f_o);
+		pthread_rwlock_unlock(&tree_lock);
+		return err;
 	}
-	free(fr_name);
-	if(target_node == NULL) {
-		free(to_name);
-		return -ENOENT;
+	if (ptdir_inode != rootDir) {
+		index_add(f_o);
+		refresh_requeue(f_o);
 	}
+	f_o->nopen++;
+	fi->fh = f_o->ino;
+	pthread_rwlock_unlock(&tree_lock);
+	return 0;
+}
 
-	switch(filetype) {
-		case 1: {
-			struct f_inode* f_o = list_entry(target_node, struct f_inode, node);
-			strcpy(f_o->name, to_name);
-			free(to_name);
-			list_add_prev(&f_o->node, &to_ptdir_inode->file_entries);
-			return 0;
-			break;
-		}
-		case 0: {
-			struct d_inode* d_o = list_entry(target_node, struct d_inode, node);
-			strcpy(d_o->name, to_name);
-			free(to_name);
-			list_add_prev(&d_o->node, &to_ptdir_inode->dir_entries);
-			return 0;
-			break;
+static int xmp_open(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, STATS_PATH) == 0) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		struct stats_file *sf = (struct stats_file *)malloc(sizeof(struct stats_file));
+		if (sf == NULL)
+			return -ENOMEM;
+		sf->data = stats_render(&sf->size, 0);
+		if (sf->data == NULL) {
+			free(sf);
+			return -ENOMEM;
 		}
-		case -1:
-			break;
-		default:
-			break;
+		//st_size is 0, so the snapshot must bypass the page cache
+		fi->direct_io = 1;
+		fi->fh = stats_fh(sf);
+		return 0;
+	}
+
+	//files seen through a range view open for reading only
+	int in_view = range_split(path, NULL);
+	if (in_view && (fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	pthread_rwlock_wrlock(&tree_lock);
+	struct inode *i = in_view ? lookup_view(path) : lookup_inode(path);
+	int err = i == NULL ? -ENOENT : i->type == INODE_DIR ? -EISDIR : 0;
+	if (err == 0) {
+		i->nopen++;
+		if (i->type == INODE_FILE && i->file.lazy != LAZY_NONE &&
+		    (err = lazy_fill(i)) != 0)
+			inode_unpin(i);
+		else
+			fi->fh = i->ino;
 	}
-	free(to_name);
-	return -EINVAL;
+	pthread_rwlock_unlock(&tree_lock);
+	return err;
 }
 
-static int xmp_link (const char *from, const char *to) {
-	char *fr_name;
-	struct d_inode *fr_ptdir_inode;
-	if(get_parent_inode(from, &fr_ptdir_inode, &fr_name) || fr_name == NULL || fr_ptdir_inode == NULL)
+//The user changed the contents of result file i, which are theirs from now
+//on: touch and the refresher leave it alone, the validators of the page are
+//dropped, and a page not fetched yet never will be.
+static void spider_forget(struct inode *i) {
+	struct xattr_ent *e;
+	i->file.fetched = 0;
+	refresh_requeue(i);
+	if ((e = xattr_find(i->xattrs, XATTR_SPIDER "etag")) != NULL)
+		xattr_del(i->xattrs, e);
+	if ((e = xattr_find(i->xattrs, XATTR_SPIDER "last_modified")) != NULL)
+		xattr_del(i->xattrs, e);
+	if (i->file.lazy != LAZY_NONE)
+		lazy_set(i, LAZY_NONE);
+}
+
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	struct stats_file *sf = fh_stats(fi->fh);
+	if (sf != NULL) {
+		if (offset < sf->size) {
+			if (offset + size > sf->size)
+				size = sf->size - offset;
+			memcpy(buf, sf->data + offset, size);
+		} else
+			size = 0;
+		return size;
+	}
+
+	struct inode *target_inode = inode_get(fi->fh);
+	if(target_inode == NULL)
 		return -ENOENT;
+	if(target_inode->type != INODE_FILE)
+		return -EISDIR;
+	if (offset < target_inode->file.size) {
+		if (offset + size > target_inode->file.size)
+			size = target_inode->file.size - offset;
+		memcpy(buf, target_inode->file.contents + offset, size);
+	} else
+		size = 0;
+	return size;
+}
 
-	char *to_name;
-	struct d_inode *to_ptdir_inode;
-	if(get_parent_inode(to, &to_ptdir_inode, &to_name) || to_name == NULL || to_ptdir_inode == NULL) {
-		free(fr_name);
+static int xmp_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	struct inode *target_inode = handle_inode(path, fi);
+	if(target_inode == NULL)
 		return -ENOENT;
+	if(target_inode->type != INODE_FILE)
+		return -EISDIR;
+	size_t new_size = offset + size;
+	int err = content_reserve(target_inode, new_size, 1);
+	if (err)
+		return err;
+	//what was written is the user's own text, not search results
+	index_remove(target_inode);
+	spider_forget(target_inode);
+	if (new_size > target_inode->file.size) {
+		memset(target_inode->file.contents + target_inode->file.size, 0,
+		       new_size - target_inode->file.size);
+		target_inode->file.size = new_size;
 	}
+	memcpy(target_inode->file.contents + offset, buf, size);
+	inode_touch(target_inode, 1);
+	return size;
+}
 
-	if (strlen(to_name) > MAX_NAMELEN) {
-		free(to_name);
-		return -ENAMETOOLONG;
-	}
+static int xmp_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	struct inode *i = handle_inode(path, fi);
+	if (i == NULL)
+		return -ENOENT;
+	if (i->type == INODE_DIR)
+		return -EISDIR;
+	if (i->type != INODE_FILE || size < 0)
+		return -EINVAL;
+	//so that growing can't fail once the old contents are unindexed
+	int err = (size_t)size > i->file.size ? content_reserve(i, size, 0) : 0;
+	if (err)
+		return err;
+	index_remove(i);
+	spider_forget(i);
+	err = content_resize(i, size);
+	if (err)
+		return err;
+	inode_touch(i, 1);
+	return 0;
+}
 
-	struct list_node *n;
-	list_for_each (n, &to_ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(to_name, o->name) == 0) {
-			free(fr_name);
-			free(to_name);
-			return -EEXIST;
+//Reserve room for offset + length bytes, and unless FALLOC_FL_KEEP_SIZE is
+//given extend the file to it with zeros. Punching holes is not supported.
+static int xmp_fallocate(const char *path, int mode, off_t offset, off_t length,
+			 struct fuse_file_info *fi)
+{
+	struct inode *i = handle_inode(path, fi);
+	if (i == NULL)
+		return -ENOENT;
+	if (i->type == INODE_DIR)
+		return -EISDIR;
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (i->type != INODE_FILE || offset < 0 || length <= 0)
+		return -EINVAL;
+	size_t end = offset + length;
+	int err = content_reserve(i, end, 0);
+	if (err == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > i->file.size) {
+		//zeros end terms like any separator, so the index stays valid
+		err = content_resize(i, end);
+		if (err == 0) {
+			spider_forget(i);
+			inode_touch(i, 1);
 		}
 	}
+	return err;
+}
 
-	list_for_each (n, &to_ptdir_inode->dir_entries) {
-		struct d_inode *o = list_entry(n, struct d_inode, node);
-		if (strcmp(to_name, o->name) == 0) {
-			free(fr_name);
-			free(to_name);
-			return -EEXIST;
+//Copying a whole file over an empty or shorter one shares its contents;
+//anything else is copied.
+static ssize_t xmp_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+				   off_t offset_in, const char *path_out,
+				   struct fuse_file_info *fi_out, off_t offset_out,
+				   size_t size, int flags)
+{
+	struct inode *in = handle_inode(path_in, fi_in);
+	struct inode *out = handle_inode(path_out, fi_out);
+	if (in == NULL || out == NULL)
+		return -ENOENT;
+	if (in->type == INODE_DIR || out->type == INODE_DIR)
+		return -EISDIR;
+	if (in->type != INODE_FILE || out->type != INODE_FILE || flags != 0 ||
+	    offset_in < 0 || offset_out < 0)
+		return -EINVAL;
+	if ((size_t)offset_in >= in->file.size)
+		return 0;
+	if (size > in->file.size - offset_in)
+		size = in->file.size - offset_in;
+
+	if (offset_in == 0 && offset_out == 0 && size == in->file.size &&
+	    size >= out->file.size) {
+		if (in != out) {
+			index_remove(out);
+			spider_forget(out);
+			content_share(out, in);
 		}
+	} else {
+		size_t end = offset_out + size;
+		int err = content_reserve(out, end, 1);
+		if (err)
+			return err;
+		index_remove(out);
+		spider_forget(out);
+		if (end > out->file.size) {
+			memset(out->file.contents + out->file.size, 0, end - out->file.size);
+			out->file.size = end;
+		}
+		//in's contents are looked up again: reserving may have moved them
+		memmove(out->file.contents + offset_out, in->file.contents + offset_in, size);
 	}
+	inode_touch(out, 1);
+	return size;
+}
 
-	int filetype = -1;
-	struct list_node *target_node;
-	list_for_each (n, &fr_ptdir_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		if (strcmp(fr_name, o->name) == 0) {
-			filetype = 1;
-			target_node = n;
-			break;
-		}
+static int xmp_release(const char *path, struct fuse_file_info *fi)
+{
+	struct stats_file *sf = fh_stats(fi->fh);
+	if (sf != NULL) {
+		free(sf->data);
+		free(sf);
+		return 0;
 	}
-	free(fr_name);
-	if(target_node == NULL) {
-		free(to_name);
+	struct inode *i = inode_get(fi->fh);
+	if (i != NULL)
+		inode_unpin(i);
+	return 0;
+}
+
+//Resolve both ends of a rename/link/symlink: the source entry must exist
+//and the target name must be free.
+static int resolve_pair(const char *from, const char *to, struct inode **fr_ptdir_inode,
+			struct dentry **fr_entry, struct inode **to_ptdir_inode, const char **to_name) {
+	const char *fr_name;
+	if(get_parent_inode(from, fr_ptdir_inode, &fr_name) || fr_name == NULL || *fr_ptdir_inode == NULL)
+		return -ENOENT;
+	*fr_entry = dir_find(*fr_ptdir_inode, fr_name);
+	if(*fr_entry == NULL)
 		return -ENOENT;
-	}
 
-	switch(filetype) {
-		case 1: {
-			struct f_inode* p_f_o = list_entry(target_node, struct f_inode, node);
-			struct f_inode *f_o = (struct f_inode *)malloc(sizeof(struct f_inode));
-			strcpy(f_o->name, to_name);
-			if(p_f_o->p_node != NULL) {
-				f_o->p_node = p_f_o->p_node;
-				struct f_inode* pp_f_o = list_entry(p_f_o->p_node, struct f_inode, node);
-				pp_f_o->nlink++;
-			}
-			else {
-				f_o->p_node = &p_f_o->node;
-				p_f_o->nlink++;
-			}
-			free(to_name);
-			list_add_prev(&f_o->node, &to_ptdir_inode->file_entries);
-			return 0;
-			break;
-		}
-		case -1:
-			break;
-		default:
-			break;
-	}
-	free(to_name);
-	return -EINVAL;
+	int err = new_entry(to, to_ptdir_inode, to_name);
+	if (err)
+		return err;
+	return 0;
 }
 
-static size_t min(size_t a, size_t b) {
-	return a > b ? b : a;
+static int xmp_rename (const char *from, const char *to, unsigned int flags) {
+	if (flags)
+		return -EINVAL;
+
+	struct inode *fr_ptdir_inode, *to_ptdir_inode;
+	struct dentry *fr_entry;
+	const char *to_name;
+	int err = resolve_pair(from, to, &fr_ptdir_inode, &fr_entry, &to_ptdir_inode, &to_name);
+	if (err)
+		return err;
+
+	//a directory can't be moved below itself
+	size_t len = strlen(from);
+	if (fr_entry->inode->type == INODE_DIR && strncmp(to, from, len) == 0 && to[len] == '/')
+		return -EINVAL;
+
+	struct inode *i = fr_entry->inode;
+	if (dir_link(to_ptdir_inode, to_name, i) == NULL)
+		return -ENOMEM;
+	dir_unlink(fr_ptdir_inode, fr_entry);
+	i->nlink--;
+	inode_touch(i, 0);
+	return 0;
+}
+
+static int xmp_link (const char *from, const char *to) {
+	struct inode *fr_ptdir_inode, *to_ptdir_inode;
+	struct dentry *fr_entry;
+	const char *to_name;
+	int err = resolve_pair(from, to, &fr_ptdir_inode, &fr_entry, &to_ptdir_inode, &to_name);
+	if (err)
+		return err;
+
+	if (fr_entry->inode->type == INODE_DIR)
+		return -EPERM;
+	struct dentry *e = dir_link(to_ptdir_inode, to_name, fr_entry->inode);
+	if (e == NULL)
+		return -ENOMEM;
+	inode_touch(e->inode, 0);
+	return 0;
 }
 
 static int xmp_readlink (const char *path, char *buf, size_t size) {
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
-		return -errno;
-	struct list_node *n;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			if(o->link_path != NULL) {
-				size_t m_size = min(strlen(o->link_path), size-1);
-				memcpy(buf, o->link_path, m_size);
-				buf[m_size] = '\0';
-				return 0;
-			}
-		}
+	char query[MAX_NAMELEN + 1];
+	const char *entry;
+	int kind = search_split(path, query, &entry);
+	if (kind == SEARCH_ENTRY)
+		return search_readlink(query, entry, buf, size);
+	if (kind != SEARCH_NONE)
+		return kind < 0 ? kind : -EINVAL;
+
+	struct inode *i = lookup_view(path);
+	if (i == NULL)
+		return -ENOENT;
+	if (i->type != INODE_LINK)
+		return -EINVAL;
+	size_t m_size = min(i->link.len, size-1);
+	memcpy(buf, i->link.target, m_size);
+	buf[m_size] = '\0';
+	return 0;
+}
+
+//The target is kept as given: it need not exist, and the kernel resolves it.
+static int xmp_symlink (const char *from, const char *to) {
+	struct inode *to_ptdir_inode;
+	const char *to_name;
+	size_t len = strlen(from);
+	if (len >= PATH_MAX)
+		return -ENAMETOOLONG;
+	int err = new_entry(to, &to_ptdir_inode, &to_name);
+	if (err)
+		return err;
+	if ((err = space_check(len + 1)))
+		return err;
+
+	struct inode *l_o = inode_alloc(INODE_LINK, S_IFLNK | 0777);
+	if (l_o == NULL)
+		return -ENOMEM;
+	l_o->link.target = strdup(from);
+	if (l_o->link.target != NULL) {
+		l_o->link.len = len;
+		space_add(SPACE_NAMES, len + 1);
 	}
-	list_for_each (n, &ptdir_inode->dir_entries) {
-		struct d_inode *o = list_entry(n, struct d_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			if(o->link_path != NULL) {
-				size_t m_size = min(strlen(o->link_path), size-1);
-				memcpy(buf, o->link_path, m_size);
-				buf[m_size] = '\0';
-				return 0;
-			}
-		}
+	if (l_o->link.target == NULL || dir_link(to_ptdir_inode, to_name, l_o) == NULL) {
+		inode_release(l_o);
+		return -ENOMEM;
 	}
 	return 0;
 }
 
-static int xmp_symlink (const char *from, const char *to) {
-	char *fr_name;
-	struct d_inode *fr_ptdir_inode;
-	if(get_parent_inode(from, &fr_ptdir_inode, &fr_name) || fr_name == NULL || fr_ptdir_inode == NULL)
-		return -ENOENT;
 
-	char *to_name;
-	struct d_inode *to_ptdir_inode;
-	if(get_parent_inode(to, &to_ptdir_inode, &to_name) || to_name == NULL || to_ptdir_inode == NULL) {
-		free(fr_name);
+static int xmp_chmod (const char *path, mode_t mode, struct fuse_file_info *fi) {
+	struct inode *i = handle_inode(path, fi);
+	if (i == NULL)
 		return -ENOENT;
-	}
-
-	if (strlen(to_name) > MAX_NAMELEN) {
-		free(to_name);
-		return -ENAMETOOLONG;
-	}
+	i->mode = (i->mode & S_IFMT) | (mode & 07777);
+	inode_touch(i, 0);
+	return 0;
+}
 
-	struct list_node *n;
-	list_for_each (n, &to_ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(to_name, o->name) == 0) {
-			free(fr_name);
-			free(to_name);
-			return -EEXIST;
-		}
-	}
 
-	list_for_each (n, &to_ptdir_inode->dir_entries) {
-		struct d_inode *o = list_entry(n, struct d_inode, node);
-		if (strcmp(to_name, o->name) == 0) {
-			free(fr_name);
-			free(to_name);
-			return -EEXIST;
-		}
-	}
+static int xmp_chown (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+	struct inode *i = handle_inode(path, fi);
+	if (i == NULL)
+		return -ENOENT;
+	if (uid != (uid_t)-1)
+		i->uid = uid;
+	if (gid != (gid_t)-1)
+		i->gid = gid;
+	inode_touch(i, 0);
+	return 0;
+}
 
-	int filetype = -1;
-	struct list_node *target_node;
-	list_for_each (n, &fr_ptdir_inode->dir_entries) {
-		struct d_inode* o = list_entry(n, struct d_inode, node);
-		if (strcmp(fr_name, o->name) == 0) {
-			filetype = 0;
-			target_node = n;
-			break;
-		}
-	}
-	list_for_each (n, &fr_ptdir_inode->file_entries) {
-		struct f_inode* o = list_entry(n, struct f_inode, node);
-		if (strcmp(fr_name, o->name) == 0) {
-			filetype = 1;
-			target_node = n;
-			break;
-		}
-	}
-	free(fr_name);
-	if(target_node == NULL) {
-		free(to_name);
+//Touching a result file to now also re-fetches it; the refresh runs unlocked
+//and sets mtime again only if the results changed. Setting explicit times,
+//as cp -p or tar do, only sets them.
+static int xmp_utimens (const char *path, const struct timespec tv[2],
+			struct fuse_file_info *fi) {
+	pthread_rwlock_wrlock(&tree_lock);
+	struct inode *i = handle_inode(path, fi);
+	if (i == NULL) {
+		pthread_rwlock_unlock(&tree_lock);
 		return -ENOENT;
 	}
-
-	switch(filetype) {
-		case 1: {
-			struct f_inode *f_o = (struct f_inode *)malloc(sizeof(struct f_inode));
-			strcpy(f_o->name, to_name);
-			char *f_o_path = (char *)malloc(strlen(from) + 1);
-			strcpy(f_o_path, from);
-			f_o->link_path = f_o_path;
-			f_o->mode = S_IFLNK | 0777;
-			f_o->nlink = 1;
-			f_o->size = 0;
-			free(to_name);
-			list_add_prev(&f_o->node, &to_ptdir_inode->file_entries);
-			return 0;
-			break;
-		}
-		case 0: {
-			struct d_inode *d_o = (struct d_inode *)malloc(sizeof(struct d_inode));
-			strcpy(d_o->name, to_name);
-			char *d_o_path = (char *)malloc(strlen(from) + 1);
-			strcpy(d_o_path, from);
-			d_o->link_path = d_o_path;
-			d_o->mode = S_IFLNK | 0777;
-			free(to_name);
-			list_add_prev(&d_o->node, &to_ptdir_inode->dir_entries);
-			return 0;
-			break;
-		}
-		case -1:
-			break;
-		default:
-			break;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (tv == NULL || tv[0].tv_nsec != UTIME_OMIT)
+		i->atime = tv == NULL || tv[0].tv_nsec == UTIME_NOW ? now : tv[0];
+	if (tv == NULL || tv[1].tv_nsec != UTIME_OMIT)
+		i->mtime = tv == NULL || tv[1].tv_nsec == UTIME_NOW ? now : tv[1];
+	i->ctime = now;
+	int refresh = i->type == INODE_FILE && i->file.fetched != 0 && (tv == NULL ||
+		(tv[0].tv_nsec == UTIME_NOW && tv[1].tv_nsec == UTIME_NOW));
+	if (refresh)
+		inode_pin(i);
+	pthread_rwlock_unlock(&tree_lock);
+
+	if (refresh) {
+		//the kernel takes the new attributes from our reply, so unlike the
+		//background refresh there is no cache to invalidate here
+		spider_refresh(i, FETCH_INTERACTIVE);
+		pthread_rwlock_wrlock(&tree_lock);
+		inode_unpin(i);
+		pthread_rwlock_unlock(&tree_lock);
 	}
-	free(to_name);
-	return -EINVAL;
+	return 0;
 }
 
+//Only the user namespace is stored; user.spider.* is maintained by the
+//spider and read-only from outside.
+static int xattr_check_name(struct inode *i, const char *name, int writing) {
+	if (strncmp(name, "user.", 5) != 0)
+		return -ENOTSUP;
+	if (i->type == INODE_LINK)
+		return writing ? -EPERM : -ENODATA;
+	if (writing && strncmp(name, XATTR_SPIDER, strlen(XATTR_SPIDER)) == 0)
+		return -EPERM;
+	return 0;
+}
 
-static int xmp_chmod (const char *path, mode_t mode, struct fuse_file_info *fi) {
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
+static int xmp_setxattr (const char *path, const char *name, const char *value,
+			 size_t size, int flags) {
+	struct inode *i = lookup_inode(path);
+	if (i == NULL)
 		return -ENOENT;
-	struct list_node *n;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			o->mode = mode | S_IFREG;
-			return 0;
-		}
-	}
-
-	list_for_each (n, &ptdir_inode->dir_entries) {
-		struct d_inode *o = list_entry(n, struct d_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			o->mode = mode | S_IFDIR;
-			return 0;
-		}
-	}
-	return -ENOENT;
+	int err = xattr_check_name(i, name, 1);
+	if (err == 0)
+		err = space_check(strlen(name) + size);
+	if (err)
+		return err;
+	err = xattr_set(&i->xattrs, name, value, size, flags);
+	if (err == 0)
+		inode_touch(i, 0);
+	return err;
 }
 
+static int xmp_getxattr (const char *path, const char *name, char *value, size_t size) {
+	struct inode *i = lookup_view(path);
+	if (i == NULL)
+		return -ENOENT;
+	int err = xattr_check_name(i, name, 0);
+	if (err)
+		return err == -ENOTSUP ? -ENODATA : err;
+	struct xattr_ent *e = xattr_find(i->xattrs, name);
+	if (e == NULL)
+		return -ENODATA;
+	if (size == 0)
+		return e->value_len;
+	if (size < e->value_len)
+		return -ERANGE;
+	memcpy(value, xattr_ent_value(e), e->value_len);
+	return e->value_len;
+}
 
-static int xmp_chown (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
-	char *name;
-	struct d_inode *ptdir_inode;
-	if(get_parent_inode(path, &ptdir_inode, &name) || name == NULL || ptdir_inode == NULL)
+static int xmp_listxattr (const char *path, char *list, size_t size) {
+	struct inode *i = lookup_view(path);
+	if (i == NULL)
 		return -ENOENT;
-	struct list_node *n;
-	list_for_each (n, &ptdir_inode->file_entries) {
-		struct f_inode *o = list_entry(n, struct f_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			o->uid = uid;
-			o->gid = gid;
-			return 0;
+	struct xattr_vec *v = i->xattrs;
+	size_t total = 0;
+	uint32_t off = 0;
+	while (v != NULL && off < v->used) {
+		struct xattr_ent *e = (struct xattr_ent *)(v->data + off);
+		if (size != 0) {
+			if (total + e->name_len + 1 > size)
+				return -ERANGE;
+			memcpy(list + total, xattr_ent_name(e), e->name_len);
+			list[total + e->name_len] = '\0';
 		}
+		total += e->name_len + 1;
+		off += xattr_ent_size(e);
 	}
+	return total;
+}
 
-	list_for_each (n, &ptdir_inode->dir_entries) {
-		struct d_inode *o = list_entry(n, struct d_inode, node);
-		if (strcmp(name, o->name) == 0) {
-			o->uid = uid;
-			o->gid = gid;
-			return 0;
-		}
-	}
-	return -ENOENT;
+static int xmp_removexattr (const char *path, const char *name) {
+	struct inode *i = lookup_inode(path);
+	if (i == NULL)
+		return -ENOENT;
+	int err = xattr_check_name(i, name, 1);
+	if (err)
+		return err;
+	struct xattr_ent *e = xattr_find(i->xattrs, name);
+	if (e == NULL)
+		return -ENODATA;
+	xattr_del(i->xattrs, e);
+	inode_touch(i, 0);
+	return 0;
+}
+
+//Sizes are in SPACE_BLOCK units; free inodes are what the free space could
+//still hold in bare inodes.
+#define SPACE_BLOCK 4096
+
+static int xmp_statfs(const char *path, struct statvfs *st) {
+	uint64_t used = space_used();
+	uint64_t avail = used < space_capacity ? space_capacity - used : 0;
+	memset(st, 0, sizeof(struct statvfs));
+	st->f_bsize = SPACE_BLOCK;
+	st->f_frsize = SPACE_BLOCK;
+	st->f_blocks = space_capacity / SPACE_BLOCK;
+	st->f_bfree = avail / SPACE_BLOCK;
+	st->f_bavail = st->f_bfree;
+	st->f_ffree = avail / sizeof(struct inode);
+	st->f_favail = st->f_ffree;
+	st->f_files = __atomic_load_n(&space_inodes, __ATOMIC_RELAXED) + st->f_ffree;
+	st->f_namemax = MAX_NAMELEN;
+	return 0;
 }
 
 static void xmp_destroy (void * exit) {
-	free_dir_node(rootDir);
-	int i;
-	for(i=0; i<spider_url_size; i++) {
-		free(spider_url[i]);
-	}
-	for(i=0; i<spider_title_size; i++) {
-		free(spider_title[i]);
-	}
+	reap_end();
+	pthread_rwlock_wrlock(&tree_lock);
+	refresh_stop = 1;
+	inode_put(rootDir);
+	pthread_rwlock_unlock(&tree_lock);
+	pool_destroy(&exec_pool);
 	return;
 }
 
+//**********************************************************************************
+//Locked entry points
+//
+//Run an operation with the tree lock held for its whole duration: shared for
+//the ones that only look, exclusive for the ones that change something.
+//mkdir, create, open and utimens lock by themselves around their fetches.
+//**********************************************************************************
+#define LOCKED_OP(lock, op, params, args) \
+static int locked_##op params { \
+	pthread_rwlock_##lock(&tree_lock); \
+	int ret = xmp_##op args; \
+	pthread_rwlock_unlock(&tree_lock); \
+	return ret; \
+}
+
+LOCKED_OP(rdlock, getattr, (const char *path, struct stat *st, struct fuse_file_info *fi),
+	  (path, st, fi))
+LOCKED_OP(rdlock, opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(rdlock, readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+			    struct fuse_file_info *fi, enum fuse_readdir_flags flags),
+	  (path, buf, filler, offset, fi, flags))
+LOCKED_OP(rdlock, read, (const char *path, char *buf, size_t size, off_t offset,
+			 struct fuse_file_info *fi), (path, buf, size, offset, fi))
+LOCKED_OP(rdlock, readlink, (const char *path, char *buf, size_t size), (path, buf, size))
+LOCKED_OP(rdlock, getxattr, (const char *path, const char *name, char *value, size_t size),
+	  (path, name, value, size))
+LOCKED_OP(rdlock, listxattr, (const char *path, char *list, size_t size), (path, list, size))
+LOCKED_OP(wrlock, write, (const char *path, const char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi), (path, buf, size, offset, fi))
+LOCKED_OP(wrlock, release, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(wrlock, rename, (const char *from, const char *to, unsigned int flags),
+	  (from, to, flags))
+LOCKED_OP(wrlock, rmdir, (const char *path), (path))
+LOCKED_OP(wrlock, unlink, (const char *path), (path))
+LOCKED_OP(wrlock, link, (const char *from, const char *to), (from, to))
+LOCKED_OP(wrlock, symlink, (const char *from, const char *to), (from, to))
+LOCKED_OP(wrlock, chmod, (const char *path, mode_t mode, struct fuse_file_info *fi),
+	  (path, mode, fi))
+LOCKED_OP(wrlock, chown, (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi),
+	  (path, uid, gid, fi))
+LOCKED_OP(wrlock, setxattr, (const char *path, const char *name, const char *value,
+			     size_t size, int flags), (path, name, value, size, flags))
+LOCKED_OP(wrlock, removexattr, (const char *path, const char *name), (path, name))
+LOCKED_OP(wrlock, truncate, (const char *path, off_t size, struct fuse_file_info *fi),
+	  (path, size, fi))
+LOCKED_OP(wrlock, fallocate, (const char *path, int mode, off_t offset, off_t length,
+			      struct fuse_file_info *fi), (path, mode, offset, length, fi))
+
+static ssize_t locked_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+				      off_t offset_in, const char *path_out,
+				      struct fuse_file_info *fi_out, off_t offset_out,
+				      size_t size, int flags) {
+	pthread_rwlock_wrlock(&tree_lock);
+	ssize_t ret = xmp_copy_file_range(path_in, fi_in, offset_in, path_out, fi_out,
+					  offset_out, size, flags);
+	pthread_rwlock_unlock(&tree_lock);
+	return ret;
+}
+
+//**********************************************************************************
+//Timed entry points for the operations reported in /.stats
+//**********************************************************************************
+static int stats_getattr(const char *path, struct stat *st,
+			 struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now_ns();
+	int ret = locked_getattr(path, st, fi);
+	stats_record(OP_GETATTR, start, ret);
+	return ret;
+}
+
+static int stats_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+	uint64_t start = stats_now_ns();
+	int ret = locked_readdir(path, buf, filler, offset, fi, flags);
+	stats_record(OP_READDIR, start, ret);
+	return ret;
+}
+
+static int stats_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now_ns();
+	int ret = locked_read(path, buf, size, offset, fi);
+	stats_record(OP_READ, start, ret);
+	if (ret > 0)
+		stats_add(bytes_read, ret);
+	return ret;
+}
+
+static int stats_write(const char *path, const char *buf, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now_ns();
+	int ret = locked_write(path, buf, size, offset, fi);
+	stats_record(OP_WRITE, start, ret);
+	if (ret > 0)
+		stats_add(bytes_written, ret);
+	return ret;
+}
+
+static int stats_mkdir(const char *path, mode_t mode)
+{
+	uint64_t start = stats_now_ns();
+	int ret = xmp_mkdir(path, mode);
+	stats_record(OP_MKDIR, start, ret);
+	return ret;
+}
+
+static int stats_create(const char *path, mode_t mode,
+			struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now_ns();
+	int ret = xmp_create(path, mode, fi);
+	stats_record(OP_CREATE, start, ret);
+	return ret;
+}
+
 static struct fuse_operations xmp_oper = {
 	.init       = xmp_init,
-	.getattr	= xmp_getattr,
-	.rename     = xmp_rename,
-	.readdir	= xmp_readdir,
-	.mkdir		= xmp_mkdir,
-	.rmdir		= xmp_rmdir,
-	.create 	= xmp_create,
+	.getattr	= stats_getattr,
+	.rename     = locked_rename,
+	.opendir    = locked_opendir,
+	.readdir	= stats_readdir,
+	.releasedir = xmp_releasedir,
+	.mkdir		= stats_mkdir,
+	.rmdir		= locked_rmdir,
+	.create 	= stats_create,
 	.open       = xmp_open,
-	.read		= xmp_read,
-	.write		= xmp_write,
-	.unlink		= xmp_unlink,
-	.link       = xmp_link,
-	.symlink    = xmp_symlink,
-	.readlink   = xmp_readlink,
-	.chmod      = xmp_chmod,
-	.chown      = xmp_chown,
+	.release    = locked_release,
+	.read		= stats_read,
+	.write		= stats_write,
+	.unlink		= locked_unlink,
+	.link       = locked_link,
+	.symlink    = locked_symlink,
+	.readlink   = locked_readlink,
+	.chmod      = locked_chmod,
+	.chown      = locked_chown,
+	.utimens    = xmp_utimens,
+	.truncate   = locked_truncate,
+	.fallocate  = locked_fallocate,
+	.copy_file_range = locked_copy_file_range,
+	.setxattr   = locked_setxattr,
+	.getxattr   = locked_getxattr,
+	.listxattr  = locked_listxattr,
+	.removexattr = locked_removexattr,
+	.statfs     = xmp_statfs,
 	.destroy    = xmp_destroy,
 };
 
+//**********************************************************************************
+//Pinned session loop
+//
+//fuse_main's multithreaded loop grows and shrinks its pool on demand and lets
+//the scheduler move the workers around. With --pinned-workers the session is
+//served instead by a fixed set of threads, one per allowed CPU, each pinned
+//to its core and reading /dev/fuse straight into its own buffer, so requests
+//don't migrate between caches and no thread is ever spawned under load.
+//**********************************************************************************
+struct loop_worker {
+	pthread_t tid;
+	int cpu;		/* -1 if not pinned */
+	struct fuse_session *se;
+};
+
+static sem_t loop_done;
+
+static void loop_worker_free(void *buf) {
+	free(((struct fuse_buf *)buf)->mem);
+}
+
+static void *loop_worker_main(void *arg) {
+	struct loop_worker *w = arg;
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	struct fuse_buf buf;
+	memset(&buf, 0, sizeof(buf));
+	pthread_cleanup_push(loop_worker_free, &buf);
+	while (!fuse_session_exited(w->se)) {
+		int res = fuse_session_receive_buf(w->se, &buf);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			fuse_session_exit(w->se);
+			break;
+		}
+		//only a worker blocked in the read may be cancelled
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		fuse_session_process_buf(w->se, &buf);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	pthread_cleanup_pop(1);
+	sem_post(&loop_done);
+	return NULL;
+}
+
+//Serve se until it is unmounted or a signal ends it.
+static int pinned_loop(struct fuse *fuse, unsigned int nworkers) {
+	struct fuse_session *se = fuse_get_session(fuse);
+	cpu_set_t allowed;
+	int ncpus = 0, cpu;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		ncpus = CPU_COUNT(&allowed);
+	if (nworkers == 0)
+		nworkers = ncpus > 0 ? ncpus : 1;
+
+	struct loop_worker *ws = (struct loop_worker *)calloc(nworkers, sizeof(struct loop_worker));
+	if (ws == NULL)
+		return -ENOMEM;
+	if (fuse_start_cleanup_thread(fuse) != 0) {
+		free(ws);
+		return -ENOMEM;
+	}
+	sem_init(&loop_done, 0, 0);
+
+	//hand out the allowed CPUs round-robin
+	unsigned int i, started = 0;
+	int err = 0;
+	for (i = 0, cpu = -1; i < nworkers; i++) {
+		ws[i].se = se;
+		ws[i].cpu = -1;
+		if (ncpus > 0) {
+			do
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			while (!CPU_ISSET(cpu, &allowed));
+			ws[i].cpu = cpu;
+		}
+		err = pthread_create(&ws[i].tid, NULL, loop_worker_main, &ws[i]);
+		if (err) {
+			fprintf(stderr, "dirSpider: cannot start worker: %s\n", strerror(err));
+			fuse_session_exit(se);
+			break;
+		}
+		started++;
+	}
+
+	//the signal handlers only flag the session; the wait returns with EINTR
+	while (started > 0 && !fuse_session_exited(se))
+		sem_wait(&loop_done);
+	for (i = 0; i < started; i++)
+		pthread_cancel(ws[i].tid);
+	for (i = 0; i < started; i++)
+		pthread_join(ws[i].tid, NULL);
+
+	fuse_stop_cleanup_thread(fuse);
+	sem_destroy(&loop_done);
+	free(ws);
+	fuse_session_reset(se);
+	return err ? -err : 0;
+}
+
+//fuse_main with pinned_loop in place of the stock loop.
+static int pinned_main(struct fuse_args *args) {
+	struct fuse_cmdline_opts opts;
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+	if (opts.show_help || opts.show_version || opts.mountpoint == NULL) {
+		fprintf(stderr, "dirSpider: --pinned-workers needs a mountpoint; "
+			"run without it for --help or --version\n");
+		free(opts.mountpoint);
+		return 1;
+	}
+
+	int ret = 1;
+	struct fuse *fuse = fuse_new(args, &xmp_oper, sizeof(xmp_oper), NULL);
+	if (fuse == NULL)
+		goto out;
+	if (fuse_mount(fuse, opts.mountpoint) != 0)
+		goto out_destroy;
+	if (fuse_daemonize(opts.foreground) != 0)
+		goto out_unmount;
+	struct fuse_session *se = fuse_get_session(fuse);
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_unmount;
+	ret = pinned_loop(fuse, options.workers) ? 1 : 0;
+	fuse_remove_signal_handlers(se);
+out_unmount:
+	fuse_unmount(fuse);
+out_destroy:
+	fuse_destroy(fuse);
+out:
+	free(opts.mountpoint);
+	return ret;
+}
+
+#define OPTION(t, p) { t, offsetof(struct xmp_options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+	OPTION("--stats-socket=%s", stats_socket),
+	OPTION("--search-base=%s", search_base),
+	OPTION("--refresh-ttl=%u", refresh_ttl),
+	OPTION("--refresh-rate=%u", refresh_rate),
+	OPTION("--fetch-inflight=%u", fetch_inflight),
+	OPTION("--fetch-rate=%u", fetch_rate),
+	OPTION("--fetch-queue=%u", fetch_queue),
+	OPTION("--fetch-timeout=%u", fetch_timeout),
+	OPTION("--fetch-retries=%u", fetch_retries),
+	OPTION("--lazy-mkdir", lazy_mkdir),
+	OPTION("--pinned-workers", pinned_workers),
+	OPTION("--workers=%u", workers),
+	OPTION("--pool-threads=%u", pool_threads),
+	OPTION("--capacity-mb=%u", capacity_mb),
+	OPTION("--record=%s", record),
+	OPTION("--replay=%s", replay),
+	OPTION("--replay-latency=%u", replay_latency),
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[])
 {
-	rootDir = (struct d_inode *)malloc(sizeof(struct d_inode));
-	list_init(&rootDir->file_entries);
-	list_init(&rootDir->dir_entries);
-	return fuse_main(argc, argv, &xmp_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	options.search_base = strdup("http://www.baidu.com/s");
+	options.refresh_rate = 1;
+	options.fetch_inflight = 4;
+	options.fetch_rate = 10;
+	options.fetch_queue = 64;
+	options.fetch_timeout = 30;
+	options.fetch_retries = 3;
+	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+		return 1;
+	if (options.fetch_inflight == 0)
+		options.fetch_inflight = 1;
+	if (options.fetch_rate == 0)
+		options.fetch_rate = 1;
+	if (options.fetch_queue == 0)
+		options.fetch_queue = 1;
+	if (options.fetch_timeout == 0)
+		options.fetch_timeout = 1;
+	if (options.capacity_mb != 0)
+		space_capacity = (uint64_t)options.capacity_mb << 20;
+	else
+		space_capacity = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	if (options.replay != NULL) {
+		int n = replay_load(options.replay);
+		if (n < 0) {
+			fprintf(stderr, "dirSpider: cannot read %s: %s\n", options.replay, strerror(-n));
+			return 1;
+		}
+		fprintf(stderr, "dirSpider: replaying %d pages from %s\n", n, options.replay);
+	}
+	if (options.record != NULL) {
+		int err = record_open(options.record);
+		if (err) {
+			fprintf(stderr, "dirSpider: cannot record to %s: %s\n", options.record, strerror(-err));
+			return 1;
+		}
+	}
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	//xpath() runs on several pool threads at once
+	xmlInitParser();
+	pthread_key_create(&stats_key, stats_thread_exit);
+
+	rootDir = inode_alloc(INODE_DIR, S_IFDIR | 0755);
+	rootDir->nlink = 1;
+	int ret;
+	if (options.pinned_workers)
+		ret = pinned_main(&args);
+	else
+		ret = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
 }
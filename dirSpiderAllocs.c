@@ -0,0 +1,118 @@
+/** @file
+ *
+ * Allocation counter for dirSpider, preloaded into the daemon by the
+ * "allocs" workload of dirSpiderBench.
+ *
+ * Counts the malloc, calloc, realloc, strdup and strndup calls made by the
+ * dirSpider executable itself; libfuse, libcurl and libc allocate for their
+ * own reasons and are left out. The count goes to the first 8 bytes of the
+ * file named by DIRSPIDER_ALLOCS, which the bench maps as well and resets
+ * and reads around the operations it measures; the next 8 bytes are set to
+ * 1 once the shim is loaded, so a daemon that ran without it cannot pass.
+ * Without DIRSPIDER_ALLOCS nothing is counted.
+ *
+ * Relies on glibc exporting its allocator as __libc_malloc and friends.
+ *
+ * Compile with
+ *
+ *     gcc -Wall -O2 -shared -fPIC dirSpiderAllocs.c -o dirSpiderAllocs.so
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <link.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t *alloc_count;
+
+//executable segments of the main program
+#define TEXT_MAX 8
+static uintptr_t text_lo[TEXT_MAX], text_hi[TEXT_MAX];
+static int text_n;
+
+//The main program comes first.
+static int find_text(struct dl_phdr_info *info, size_t size, void *arg) {
+	(void) size;
+	(void) arg;
+	int i;
+	for (i = 0; i < info->dlpi_phnum && text_n < TEXT_MAX; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X))
+			continue;
+		text_lo[text_n] = info->dlpi_addr + ph->p_vaddr;
+		text_hi[text_n] = text_lo[text_n] + ph->p_memsz;
+		text_n++;
+	}
+	return 1;
+}
+
+__attribute__((constructor))
+static void allocs_init(void) {
+	const char *path = getenv("DIRSPIDER_ALLOCS");
+	if (path == NULL)
+		return;
+	dl_iterate_phdr(find_text, NULL);
+	int fd = open(path, O_RDWR);
+	if (fd < 0)
+		return;
+	void *p = mmap(NULL, 2 * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+	alloc_count = (uint64_t *)p;
+	__atomic_store_n(&alloc_count[1], 1, __ATOMIC_SEQ_CST);
+}
+
+static void count(void *caller) {
+	uintptr_t pc = (uintptr_t)caller;
+	int i;
+	if (alloc_count == NULL)
+		return;
+	for (i = 0; i < text_n; i++)
+		if (pc >= text_lo[i] && pc < text_hi[i]) {
+			__atomic_add_fetch(alloc_count, 1, __ATOMIC_RELAXED);
+			return;
+		}
+}
+
+void *malloc(size_t size) {
+	count(__builtin_return_address(0));
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	count(__builtin_return_address(0));
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	count(__builtin_return_address(0));
+	return __libc_realloc(ptr, size);
+}
+
+char *strdup(const char *s) {
+	size_t n = strlen(s) + 1;
+	count(__builtin_return_address(0));
+	char *d = (char *)__libc_malloc(n);
+	return d != NULL ? (char *)memcpy(d, s, n) : NULL;
+}
+
+char *strndup(const char *s, size_t max) {
+	size_t n = strnlen(s, max);
+	count(__builtin_return_address(0));
+	char *d = (char *)__libc_malloc(n + 1);
+	if (d == NULL)
+		return NULL;
+	memcpy(d, s, n);
+	d[n] = '\0';
+	return d;
+}
@@ -0,0 +1,875 @@
+/** @file
+ *
+ * Benchmark and load generator for dirSpider.
+ *
+ * Every workload gets a fresh mount of the dirSpider binary in a temporary
+ * directory, with --search-base pointed at a mock search server running
+ * inside this process, so results don't depend on the network. One JSON
+ * object per workload is printed to stdout:
+ *
+ *     {"workload":"meta","ops":30000,"secs":1.52,"ops_per_sec":19736.8,
+ *      "p50_us":41.0,"p99_us":180.0,"p999_us":610.0,"max_us":1200.0,
+ *      "rss_kb":2140,"cpu_us_per_op":38.2,"loop":"default"}
+ *
+ * rss_kb is the resident set size of the daemon after the workload and
+ * cpu_us_per_op the user+system CPU time the daemon spent per operation.
+ * -L picks the daemon's session loop: "default" (fuse_main), "pinned"
+ * (--pinned-workers) or "both", which runs every workload under each loop
+ * for a side by side comparison.
+ *
+ * -a record:FILE has the daemon keep every page it fetches from the mock
+ * server in an archive, and -a replay:FILE serves them from one instead, so
+ * runs can be repeated against exactly the same pages, e.g. ones recorded
+ * from the real upstream.
+ *
+ * Some workloads also check the daemon and make the run fail when it is
+ * off. "teardown" builds a tree of -n nodes, removes it with a single rmdir
+ * and waits for the background reaper, after which every counter in /.stats
+ * must be back where it was before the tree. When the daemon is built with
+ * -fsanitize=address, LeakSanitizer runs as it unmounts, and the run fails
+ * whenever the daemon exits with an error, e.g.
+ *
+ *     gcc -g -fsanitize=address dirSpider.c ... -o dirSpider
+ *     dirSpiderBench -w teardown -n 1000000
+ *
+ * "unlinked" writes a file, unlinks it while open and then reads it back
+ * and closes it through the descriptor, which must keep working and must
+ * not take the daemon down.
+ *
+ * "allocs" preloads dirSpiderAllocs.so (-p) into the daemon and repeats
+ * getattr, open, read, write and release on files that already exist, plus
+ * lookups of a range view and of a missing name. After a warm-up pass every
+ * heap allocation the daemon itself makes counts, and any fails the run.
+ *
+ * Compile with
+ *
+ *     gcc -Wall -O2 dirSpiderBench.c -lpthread -o dirSpiderBench
+ *     gcc -Wall -O2 -shared -fPIC dirSpiderAllocs.c -o dirSpiderAllocs.so
+ *
+ * Usage
+ *
+ *     dirSpiderBench [-b ./dirSpider] [-w meta,deep,seq,rand,readdir,mkdir,teardown,unlinked,allocs]
+ *                    [-n ops] [-t threads] [-s file_kb] [-d depth]
+ *                    [-r results_per_page] [-l mock_latency_ms]
+ *                    [-L default|pinned|both] [-a record:FILE|replay:FILE]
+ *                    [-p ./dirSpiderAllocs.so]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "c_stats.h"
+
+struct bench_config {
+	const char *binary;
+	const char *workloads;
+	int ops;
+	int threads;
+	size_t file_size;
+	int depth;
+	int results;
+	int latency_ms;
+	const char *loops;
+	const char *archive;	/* "record:FILE" or "replay:FILE" */
+	const char *alloc_shim;
+};
+
+static struct bench_config config = {
+	.binary     = "./dirSpider",
+	.workloads  = "meta,deep,seq,rand,readdir,mkdir",
+	.ops        = 10000,
+	.threads    = 4,
+	.file_size  = 64 << 20,
+	.depth      = 32,
+	.results    = 10,
+	.latency_ms = 0,
+	.loops      = "default",
+	.alloc_shim = "./dirSpiderAllocs.so",
+};
+
+//**********************************************************************************
+//Mock search server
+//
+//Answers every GET with a page shaped like the upstream result page, i.e. what
+//the xpath expressions in dirSpider's process() look for.
+//**********************************************************************************
+static int mock_port;
+
+static void *mock_conn(void *arg) {
+	int c = (int)(intptr_t)arg;
+	char req[4096];
+	ssize_t n = read(c, req, sizeof(req) - 1);
+	if (n > 0) {
+		req[n] = '\0';
+		if (config.latency_ms > 0)
+			usleep(config.latency_ms * 1000);
+
+		char *body = NULL;
+		size_t body_len = 0;
+		FILE *f = open_memstream(&body, &body_len);
+		int i;
+		fprintf(f, "<html><body><div id=\"content_left\">");
+		for (i = 0; i < config.results; i++)
+			fprintf(f, "<div><h3><a href=\"http://example.com/%d/%lx\">result %d</a></h3></div>",
+				i, (unsigned long)n * 2654435761u + i, i);
+		fprintf(f, "</div></body></html>");
+		fclose(f);
+
+		char head[256];
+		int hl = snprintf(head, sizeof(head),
+			"HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+			body_len);
+		if (write(c, head, hl) == hl && write(c, body, body_len) < 0)
+			perror("mock write");
+		free(body);
+	}
+	close(c);
+	return NULL;
+}
+
+static void *mock_loop(void *arg) {
+	int fd = (int)(intptr_t)arg;
+	for (;;) {
+		int c = accept(fd, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, mock_conn, (void *)(intptr_t)c) == 0)
+			pthread_detach(tid);
+		else
+			close(c);
+	}
+	return NULL;
+}
+
+static int mock_start(void) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 128) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+	mock_port = ntohs(addr.sin_port);
+	pthread_t tid;
+	pthread_create(&tid, NULL, mock_loop, (void *)(intptr_t)fd);
+	pthread_detach(tid);
+	return 0;
+}
+
+//**********************************************************************************
+//Mount handling
+//**********************************************************************************
+struct mount {
+	char dir[64];
+	char allocs[64];	/* counter file of dirSpiderAllocs.so, or "" */
+	pid_t pid;
+	int pinned;
+};
+
+//Shared with a daemon running under dirSpiderAllocs.so: the allocation
+//count, then 1 once the shim is loaded.
+static volatile uint64_t *alloc_count;
+
+static int alloc_counter_open(struct mount *m) {
+	strcpy(m->allocs, "/tmp/dirSpiderBench.allocs.XXXXXX");
+	int fd = mkstemp(m->allocs);
+	if (fd < 0)
+		return -errno;
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, 2 * sizeof(uint64_t)) == 0)
+		p = mmap(NULL, 2 * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int err = errno;
+	close(fd);
+	if (p == MAP_FAILED) {
+		unlink(m->allocs);
+		m->allocs[0] = '\0';
+		return -err;
+	}
+	alloc_count = p;
+	return 0;
+}
+
+static void alloc_counter_close(struct mount *m) {
+	if (m->allocs[0] == '\0')
+		return;
+	munmap((void *)alloc_count, 2 * sizeof(uint64_t));
+	alloc_count = NULL;
+	unlink(m->allocs);
+}
+
+//opt is one more option for the daemon, or NULL; count_allocs preloads
+//config.alloc_shim
+static int mount_start(struct mount *m, int pinned, const char *opt, int count_allocs) {
+	int err;
+	m->pinned = pinned;
+	m->allocs[0] = '\0';
+	if (count_allocs) {
+		if (access(config.alloc_shim, R_OK) < 0)
+			return -errno;
+		if ((err = alloc_counter_open(m)) != 0)
+			return err;
+	}
+	strcpy(m->dir, "/tmp/dirSpiderBench.XXXXXX");
+	if (mkdtemp(m->dir) == NULL) {
+		err = -errno;
+		alloc_counter_close(m);
+		return err;
+	}
+
+	char base[64], archive[PATH_MAX + 16];
+	snprintf(base, sizeof(base), "--search-base=http://127.0.0.1:%d/s", mock_port);
+	//the mock server is local: measure the filesystem, not the upstream limits
+	const char *argv[10] = { config.binary, "-f", m->dir, base,
+				 "--fetch-rate=1000000", "--fetch-inflight=256" };
+	int argc = 6;
+	if (pinned)
+		argv[argc++] = "--pinned-workers";
+	if (opt != NULL)
+		argv[argc++] = opt;
+	if (config.archive != NULL) {
+		snprintf(archive, sizeof(archive), "--%.6s=%s", config.archive,
+			 strchr(config.archive, ':') + 1);
+		argv[argc++] = archive;
+	}
+	m->pid = fork();
+	if (m->pid < 0) {
+		err = -errno;
+		rmdir(m->dir);
+		alloc_counter_close(m);
+		return err;
+	}
+	if (m->pid == 0) {
+		if (count_allocs) {
+			setenv("LD_PRELOAD", config.alloc_shim, 1);
+			setenv("DIRSPIDER_ALLOCS", m->allocs, 1);
+		}
+		execv(config.binary, (char *const *)argv);
+		perror(config.binary);
+		_exit(127);
+	}
+
+	//the mount is up once the daemon answers for its own stats file
+	char stats[96];
+	snprintf(stats, sizeof(stats), "%s/.stats", m->dir);
+	int i;
+	struct stat st;
+	for (i = 0; i < 500; i++) {
+		if (stat(stats, &st) == 0)
+			return 0;
+		if (waitpid(m->pid, NULL, WNOHANG) == m->pid)
+			return -ECHILD;
+		usleep(10000);
+	}
+	return -ETIMEDOUT;
+}
+
+static long mount_rss_kb(struct mount *m) {
+	char path[64], line[256];
+	long rss = -1;
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)m->pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+			break;
+	fclose(f);
+	return rss;
+}
+
+//User plus system CPU time of the daemon so far, in microseconds.
+static double mount_cpu_us(struct mount *m) {
+	char path[64];
+	unsigned long utime, stime;
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)m->pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	//skip to field 14; the command name in field 2 may hold spaces
+	int c, ok = 0;
+	while ((c = fgetc(f)) != EOF && c != ')')
+		;
+	if (c == ')')
+		ok = fscanf(f, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			    &utime, &stime) == 2;
+	fclose(f);
+	return ok ? (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK) : -1;
+}
+
+//Returns the daemon's exit status, or -1 if it had to be killed.
+static int mount_stop(struct mount *m) {
+	int status = 0, ret = -1;
+	pid_t pid = fork();
+	if (pid == 0) {
+		execlp("fusermount3", "fusermount3", "-u", m->dir, (char *)NULL);
+		execlp("fusermount", "fusermount", "-u", m->dir, (char *)NULL);
+		_exit(127);
+	}
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+	//LeakSanitizer may take a while over a big heap
+	int i;
+	for (i = 0; i < 600 && waitpid(m->pid, &status, WNOHANG) == 0; i++)
+		usleep(100000);
+	if (i == 600) {
+		kill(m->pid, SIGTERM);
+		waitpid(m->pid, NULL, 0);
+	} else if (WIFEXITED(status))
+		ret = WEXITSTATUS(status);
+	rmdir(m->dir);
+	alloc_counter_close(m);
+	return ret;
+}
+
+//Read the counters of /.stats: inodes and space_* but the capacity.
+#define STATS_MAX 16
+
+struct stats_snap {
+	int n;
+	char key[STATS_MAX][32];
+	unsigned long long val[STATS_MAX];
+};
+
+static int stats_snap(const char *root, struct stats_snap *s) {
+	char path[256], line[256], key[64];
+	unsigned long long val;
+	snprintf(path, sizeof(path), "%s/.stats", root);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	s->n = 0;
+	while (fgets(line, sizeof(line), f) && s->n < STATS_MAX) {
+		if (sscanf(line, "%63s %llu", key, &val) != 2 || strlen(key) >= sizeof(s->key[0]))
+			continue;
+		if (strcmp(key, "inodes") != 0 &&
+		    (strncmp(key, "space_", 6) != 0 || strcmp(key, "space_capacity") == 0))
+			continue;
+		strcpy(s->key[s->n], key);
+		s->val[s->n++] = val;
+	}
+	fclose(f);
+	return s->n > 0 ? 0 : -1;
+}
+
+static unsigned long long stats_val(const struct stats_snap *s, const char *key) {
+	int i;
+	for (i = 0; i < s->n; i++)
+		if (strcmp(s->key[i], key) == 0)
+			return s->val[i];
+	return 0;
+}
+
+//**********************************************************************************
+//Workloads
+//
+//A workload runs config.threads copies of its body; each thread records into
+//its own histogram and the histograms are merged afterwards.
+//**********************************************************************************
+struct worker {
+	pthread_t tid;
+	int id;
+	const char *root;
+	long ops;
+	struct hist lat;
+	void (*body)(struct worker *);
+};
+
+#define timed(w, expr) do { \
+	uint64_t __t = stats_now_ns(); \
+	expr; \
+	hist_record(&(w)->lat, stats_now_ns() - __t); \
+	(w)->ops++; \
+} while (0)
+
+static int per_thread(void) {
+	int n = config.ops / config.threads;
+	return n > 0 ? n : 1;
+}
+
+//create + stat + unlink, each timed as one op
+static void wl_meta(struct worker *w) {
+	char path[256];
+	struct stat st;
+	int i, n = per_thread();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/m%d_%d", w->root, w->id, i);
+		timed(w, close(open(path, O_CREAT | O_WRONLY, 0644)));
+		timed(w, stat(path, &st));
+		timed(w, unlink(path));
+	}
+}
+
+static char deep_path[4096];
+
+static int deep_setup(const char *root) {
+	int i;
+	size_t len = snprintf(deep_path, sizeof(deep_path), "%s", root);
+	for (i = 0; i < config.depth; i++) {
+		len += snprintf(deep_path + len, sizeof(deep_path) - len, "/d%d", i);
+		if (len >= sizeof(deep_path) || mkdir(deep_path, 0755) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void wl_deep(struct worker *w) {
+	char leaf[4200];
+	struct stat st;
+	int i, n = per_thread();
+	snprintf(leaf, sizeof(leaf), "%s/00", deep_path);
+	for (i = 0; i < n; i++)
+		timed(w, stat(leaf, &st));
+}
+
+#define IO_BLOCK (128 << 10)
+#define RAND_BLOCK 4096
+
+static void wl_seq(struct worker *w) {
+	char path[256];
+	char *buf = malloc(IO_BLOCK);
+	size_t off;
+	memset(buf, 'a' + w->id, IO_BLOCK);
+	snprintf(path, sizeof(path), "%s/seq%d", w->root, w->id);
+	int fd = open(path, O_CREAT | O_RDWR, 0644);
+	for (off = 0; off < config.file_size; off += IO_BLOCK)
+		timed(w, pwrite(fd, buf, IO_BLOCK, off));
+	for (off = 0; off < config.file_size; off += IO_BLOCK)
+		timed(w, pread(fd, buf, IO_BLOCK, off));
+	close(fd);
+	free(buf);
+}
+
+static void wl_rand(struct worker *w) {
+	char path[256];
+	char buf[RAND_BLOCK];
+	unsigned seed = w->id + 1;
+	size_t blocks = config.file_size / RAND_BLOCK;
+	int i, n = per_thread();
+	memset(buf, 'r', sizeof(buf));
+	snprintf(path, sizeof(path), "%s/rand%d", w->root, w->id);
+	int fd = open(path, O_CREAT | O_RDWR, 0644);
+	//lay the file out first so reads never hit a hole past EOF
+	if (pwrite(fd, buf, RAND_BLOCK, (blocks - 1) * RAND_BLOCK) < 0)
+		perror("rand prefill");
+	for (i = 0; i < n; i++) {
+		off_t off = (off_t)(rand_r(&seed) % blocks) * RAND_BLOCK;
+		if (i & 1)
+			timed(w, pwrite(fd, buf, RAND_BLOCK, off));
+		else
+			timed(w, pread(fd, buf, RAND_BLOCK, off));
+	}
+	close(fd);
+}
+
+static void list_dir(const char *path) {
+	DIR *d = opendir(path);
+	if (d == NULL)
+		return;
+	while (readdir(d))
+		;
+	closedir(d);
+}
+
+//one op is a full listing of the directory
+static void wl_readdir(struct worker *w) {
+	int i, n = per_thread() / 100 + 1;
+	for (i = 0; i < n; i++)
+		timed(w, list_dir(w->root));
+}
+
+static int readdir_setup(const char *root) {
+	char path[256];
+	int i;
+	for (i = 0; i < config.ops; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", root, i);
+		int fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0)
+			return -1;
+		close(fd);
+	}
+	return 0;
+}
+
+static void wl_mkdir(struct worker *w) {
+	char path[256];
+	int i, n = per_thread() / 10 + 1;
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/q%d_%d", w->root, w->id, i);
+		timed(w, mkdir(path, 0755));
+	}
+}
+
+//Per thread a chain of directories "t<id>/d/d/...", TEARDOWN_FANOUT
+//symlinks each, none of them fetching anything: the daemon runs with
+//--lazy-mkdir. One op is the rmdir of the whole chain.
+#define TEARDOWN_FANOUT 1000
+
+static struct stats_snap teardown_base;
+
+static int teardown_setup(const char *root) {
+	char path[256], name[32];
+	int t, nodes = per_thread();
+	if (stats_snap(root, &teardown_base) < 0)
+		return -1;
+	for (t = 0; t < config.threads; t++) {
+		snprintf(path, sizeof(path), "%s/t%d", root, t);
+		if (mkdir(path, 0755) < 0)
+			return -1;
+		int fd = open(path, O_RDONLY | O_DIRECTORY), i;
+		for (i = 1; fd >= 0 && i < nodes; i++) {
+			if (i % TEARDOWN_FANOUT == 0) {
+				if (mkdirat(fd, "d", 0755) < 0)
+					break;
+				int sub = openat(fd, "d", O_RDONLY | O_DIRECTORY);
+				close(fd);
+				fd = sub;
+			} else {
+				snprintf(name, sizeof(name), "s%d", i);
+				if (symlinkat("../target", fd, name) < 0)
+					break;
+			}
+		}
+		if (fd < 0 || i < nodes) {
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+static void wl_teardown(struct worker *w) {
+	char path[256];
+	snprintf(path, sizeof(path), "%s/t%d", w->root, w->id);
+	timed(w, rmdir(path));
+}
+
+//The reaper is done once the inode count is back to what it was; then
+//nothing may be left over anywhere.
+static int teardown_check(const char *root) {
+	struct stats_snap s;
+	int i, waited;
+	uint64_t start = stats_now_ns();
+	unsigned long long base = stats_val(&teardown_base, "inodes");
+	for (waited = 0; waited < 6000; waited++) {
+		if (stats_snap(root, &s) < 0)
+			return -1;
+		if (stats_val(&s, "inodes") <= base)
+			break;
+		usleep(10000);
+	}
+	fprintf(stderr, "teardown: reaped in %.3fs\n", (stats_now_ns() - start) / 1e9);
+	int bad = 0;
+	for (i = 0; i < teardown_base.n; i++) {
+		unsigned long long now = stats_val(&s, teardown_base.key[i]);
+		if (now != teardown_base.val[i]) {
+			fprintf(stderr, "teardown: %s is %llu, was %llu before the tree\n",
+				teardown_base.key[i], now, teardown_base.val[i]);
+			bad = 1;
+		}
+	}
+	return bad ? -1 : 0;
+}
+
+//create + pwrite + unlink, then fstat + pread + close through the open
+//descriptor; one op is the whole round
+#define UNLINKED_FILE 4096
+
+static int unlinked_bad;
+
+static int unlinked_round(const char *path, char *buf, char *back) {
+	struct stat st;
+	int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	int ok = pwrite(fd, buf, UNLINKED_FILE, 0) == UNLINKED_FILE && unlink(path) == 0 &&
+		 fstat(fd, &st) == 0 && st.st_size == UNLINKED_FILE &&
+		 pread(fd, back, UNLINKED_FILE, 0) == UNLINKED_FILE &&
+		 memcmp(buf, back, UNLINKED_FILE) == 0;
+	return close(fd) == 0 && ok ? 0 : -1;
+}
+
+static void wl_unlinked(struct worker *w) {
+	char path[256], buf[UNLINKED_FILE], back[UNLINKED_FILE];
+	int i, n = per_thread(), err;
+	memset(buf, 'u' + w->id % 4, sizeof(buf));
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/u%d_%d", w->root, w->id, i);
+		timed(w, err = unlinked_round(path, buf, back));
+		if (err)
+			__atomic_add_fetch(&unlinked_bad, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int unlinked_check(const char *root) {
+	struct stat st;
+	char path[256];
+	int bad = unlinked_bad;
+	unlinked_bad = 0;
+	if (bad != 0)
+		fprintf(stderr, "unlinked: %d rounds failed\n", bad);
+	snprintf(path, sizeof(path), "%s/.stats", root);
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "unlinked: the daemon is gone\n");
+		return -1;
+	}
+	return bad != 0 ? -1 : 0;
+}
+
+//Per thread a file "a/f<id>" of ALLOC_FILE bytes in a subdirectory, so the
+//range view "a/.from/f0" has something to list. The warm-up pass lets every
+//daemon thread allocate its stats block and every buffer reach its size.
+#define ALLOC_FILE 4096
+#define ALLOC_IO 512
+
+static pthread_barrier_t alloc_barrier;
+
+static int allocs_setup(const char *root) {
+	char path[256], buf[ALLOC_FILE];
+	int t;
+	memset(buf, 'x', sizeof(buf));
+	snprintf(path, sizeof(path), "%s/a", root);
+	if (mkdir(path, 0755) < 0)
+		return -1;
+	for (t = 0; t < config.threads; t++) {
+		snprintf(path, sizeof(path), "%s/a/f%d", root, t);
+		int fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0)
+			return -1;
+		ssize_t n = pwrite(fd, buf, sizeof(buf), 0);
+		close(fd);
+		if (n != sizeof(buf))
+			return -1;
+	}
+	return pthread_barrier_init(&alloc_barrier, NULL, config.threads) ? -1 : 0;
+}
+
+//one op is stat, open, pwrite, pread and close of the file plus the two
+//lookups; a missing name is never cached, so it reaches getattr every time
+static void alloc_ops(struct worker *w, int n, int timing) {
+	char path[256], view[256], missing[256], buf[ALLOC_IO];
+	struct stat st;
+	int i;
+	memset(buf, 'a' + w->id, sizeof(buf));
+	snprintf(path, sizeof(path), "%s/a/f%d", w->root, w->id);
+	snprintf(view, sizeof(view), "%s/a/.from/f0/f%d", w->root, w->id);
+	snprintf(missing, sizeof(missing), "%s/a/none%d", w->root, w->id);
+	for (i = 0; i < n; i++) {
+		uint64_t t = stats_now_ns();
+		int fd = open(path, O_RDWR);
+		if (fd >= 0) {
+			off_t off = (off_t)(i % (ALLOC_FILE / ALLOC_IO)) * ALLOC_IO;
+			if (pwrite(fd, buf, sizeof(buf), off) < 0 ||
+			    pread(fd, buf, sizeof(buf), off) < 0)
+				perror("allocs io");
+			close(fd);
+		}
+		stat(path, &st);
+		stat(view, &st);
+		stat(missing, &st);
+		if (timing) {
+			hist_record(&w->lat, stats_now_ns() - t);
+			w->ops++;
+		}
+	}
+}
+
+static void wl_allocs(struct worker *w) {
+	int n = per_thread();
+	alloc_ops(w, n / 10 + 1, 0);
+	pthread_barrier_wait(&alloc_barrier);
+	if (w->id == 0)
+		__atomic_store_n(&alloc_count[0], 0, __ATOMIC_SEQ_CST);
+	pthread_barrier_wait(&alloc_barrier);
+	alloc_ops(w, n, 1);
+}
+
+static int allocs_check(const char *root) {
+	(void) root;
+	pthread_barrier_destroy(&alloc_barrier);
+	if (alloc_count[1] != 1) {
+		fprintf(stderr, "allocs: %s was not loaded into the daemon\n", config.alloc_shim);
+		return -1;
+	}
+	unsigned long long n = alloc_count[0];
+	if (n != 0)
+		fprintf(stderr, "allocs: the daemon allocated %llu times\n", n);
+	return n != 0 ? -1 : 0;
+}
+
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	w->body(w);
+	return NULL;
+}
+
+struct workload {
+	const char *name;
+	void (*body)(struct worker *);
+	int (*setup)(const char *root);
+	int (*check)(const char *root);	/* after the run; nonzero fails it */
+	const char *daemon_opt;
+	int count_allocs;	/* run the daemon under config.alloc_shim */
+};
+
+static const struct workload workloads[] = {
+	{ "meta",     wl_meta,     NULL },
+	{ "deep",     wl_deep,     deep_setup },
+	{ "seq",      wl_seq,      NULL },
+	{ "rand",     wl_rand,     NULL },
+	{ "readdir",  wl_readdir,  readdir_setup },
+	{ "mkdir",    wl_mkdir,    NULL },
+	{ "teardown", wl_teardown, teardown_setup, teardown_check, "--lazy-mkdir" },
+	{ "unlinked", wl_unlinked, NULL,           unlinked_check },
+	{ "allocs",   wl_allocs,   allocs_setup,   allocs_check,   NULL, 1 },
+};
+
+static int run_workload(const struct workload *wl, int pinned) {
+	struct mount m;
+	int err = mount_start(&m, pinned, wl->daemon_opt, wl->count_allocs);
+	if (err) {
+		fprintf(stderr, "%s: cannot mount %s: %s\n", wl->name, config.binary, strerror(-err));
+		return err;
+	}
+	if (wl->setup && wl->setup(m.dir) < 0) {
+		fprintf(stderr, "%s: setup failed: %s\n", wl->name, strerror(errno));
+		mount_stop(&m);
+		return -1;
+	}
+
+	struct worker *ws = calloc(config.threads, sizeof(struct worker));
+	struct hist *all = calloc(1, sizeof(struct hist));
+	long ops = 0;
+	int i;
+	double cpu_start = mount_cpu_us(&m);
+	uint64_t start = stats_now_ns();
+	for (i = 0; i < config.threads; i++) {
+		ws[i].id = i;
+		ws[i].root = m.dir;
+		ws[i].body = wl->body;
+		pthread_create(&ws[i].tid, NULL, worker_main, &ws[i]);
+	}
+	for (i = 0; i < config.threads; i++) {
+		pthread_join(ws[i].tid, NULL);
+		hist_merge(all, &ws[i].lat);
+		ops += ws[i].ops;
+	}
+	double secs = (stats_now_ns() - start) / 1e9;
+	long rss = mount_rss_kb(&m);
+	double cpu = mount_cpu_us(&m) - cpu_start;
+
+	printf("{\"workload\":\"%s\",\"threads\":%d,\"ops\":%ld,\"secs\":%.6f,\"ops_per_sec\":%.1f,"
+	       "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,\"rss_kb\":%ld,"
+	       "\"cpu_us_per_op\":%.1f,\"loop\":\"%s\"}\n",
+	       wl->name, config.threads, ops, secs, secs > 0 ? ops / secs : 0.0,
+	       hist_quantile(all, 0.5) / 1e3, hist_quantile(all, 0.99) / 1e3,
+	       hist_quantile(all, 0.999) / 1e3, all->max / 1e3, rss,
+	       ops > 0 && cpu_start >= 0 ? cpu / ops : 0.0, pinned ? "pinned" : "default");
+	fflush(stdout);
+
+	free(all);
+	free(ws);
+	err = wl->check ? wl->check(m.dir) : 0;
+	if (err)
+		fprintf(stderr, "%s: check failed\n", wl->name);
+	int status = mount_stop(&m);
+	if (status != 0) {
+		fprintf(stderr, "%s: daemon exited with status %d\n", wl->name, status);
+		err = -1;
+	}
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "b:w:n:t:s:d:r:l:L:a:p:")) != -1) {
+		switch (c) {
+			case 'b': config.binary = optarg; break;
+			case 'w': config.workloads = optarg; break;
+			case 'n': config.ops = atoi(optarg); break;
+			case 't': config.threads = atoi(optarg); break;
+			case 's': config.file_size = (size_t)atol(optarg) << 10; break;
+			case 'd': config.depth = atoi(optarg); break;
+			case 'r': config.results = atoi(optarg); break;
+			case 'l': config.latency_ms = atoi(optarg); break;
+			case 'L': config.loops = optarg; break;
+			case 'a': config.archive = optarg; break;
+			case 'p': config.alloc_shim = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-b binary] [-w workloads] [-n ops] [-t threads]"
+					" [-s file_kb] [-d depth] [-r results] [-l latency_ms]"
+					" [-L default|pinned|both] [-a record:FILE|replay:FILE]"
+					" [-p alloc_shim]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (config.threads < 1 || config.ops < 1 || config.file_size < RAND_BLOCK) {
+		fprintf(stderr, "threads, ops and file size must be positive\n");
+		return 2;
+	}
+	if (config.archive != NULL && strncmp(config.archive, "record:", 7) != 0 &&
+	    strncmp(config.archive, "replay:", 7) != 0) {
+		fprintf(stderr, "archive must be record:FILE or replay:FILE\n");
+		return 2;
+	}
+	int run_default = strcmp(config.loops, "pinned") != 0;
+	int run_pinned = strcmp(config.loops, "pinned") == 0 || strcmp(config.loops, "both") == 0;
+	if (!run_pinned && strcmp(config.loops, "default") != 0) {
+		fprintf(stderr, "unknown loop %s\n", config.loops);
+		return 2;
+	}
+	if (mock_start() < 0) {
+		perror("mock server");
+		return 1;
+	}
+
+	int failed = 0;
+	char *list = strdup(config.workloads), *save = NULL, *tok;
+	size_t i;
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+			if (strcmp(tok, workloads[i].name) == 0)
+				break;
+		if (i == sizeof(workloads) / sizeof(workloads[0])) {
+			fprintf(stderr, "unknown workload %s\n", tok);
+			failed = 1;
+			continue;
+		}
+		if (run_default && run_workload(&workloads[i], 0))
+			failed = 1;
+		if (run_pinned && run_workload(&workloads[i], 1))
+			failed = 1;
+	}
+	free(list);
+	return failed;
+}